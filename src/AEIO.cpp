@@ -274,7 +274,7 @@ AEIO_EndAdding(
 	A_long					flags)
 { 
 	// done with the render, anything to dispose?
-	return A_Err_NONE;
+	return FrameSeq_FinishOutput(basic_dataP, outH);
 }
 
 static A_Err	
@@ -316,7 +316,7 @@ AEIO_Flush(
 	/*	free any temp buffers you kept around for
 		writing.  Yes, this gets called.
 	*/
-	return A_Err_NONE; 
+	return FrameSeq_FinishOutput(basic_dataP, outH); 
 }
 
 static A_Err	
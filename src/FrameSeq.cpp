@@ -882,8 +882,30 @@ FrameSeq_DrawSparseFrame(
 							(pixel_format == PF_PixelFormat_ARGB64) ? 16 : 8;
 	
 
+	// At partial resolution, we can have the reader sample directly into a world AE's size
+	// instead of reading everything and then shrinking it down.
+	PF_Point scale = {1, 1};
+	
+	if(sparse_framePPB && sparse_framePPB->rs.x.num > 0 && sparse_framePPB->rs.y.num > 0)
+	{
+		scale.h = sparse_framePPB->rs.x.den / sparse_framePPB->rs.x.num; // scale.h = 2 means 1/2 x scale
+		scale.v = sparse_framePPB->rs.y.den / sparse_framePPB->rs.y.num;
+		
+		// only when AE's world is exactly what we'd get by sampling every Nth pixel
+		if( scale.h < 1 || scale.v < 1 ||
+			wP->width != (info.width + scale.h - 1) / scale.h ||
+			wP->height != (info.height + scale.v - 1) / scale.v )
+		{
+			scale.h = scale.v = 1;
+		}
+	}
+	
+	const A_long	world_width = (info.width + scale.h - 1) / scale.h,
+					world_height = (info.height + scale.v - 1) / scale.v;
+	
+
 	// here's the only time we won't need to make our own buffer
-	if(	(info.width == wP->width) && (info.height == wP->height) && (wP_depth == 32) )
+	if(	(world_width == wP->width) && (world_height == wP->height) && (wP_depth == 32) )
 	{
 		active_World = wP; // just use the PF_EffectWorld AE gave us
 		
@@ -892,18 +914,41 @@ FrameSeq_DrawSparseFrame(
 	else
 	{
 		// make our own PF_EffectWorld
-		err = suites.PFWorldSuite()->PF_NewWorld(NULL, info.width, info.height, FALSE,
+		err = suites.PFWorldSuite()->PF_NewWorld(NULL, world_width, world_height, FALSE,
 												PF_PixelFormat_ARGB128, temp_World);
 		
 		active_World = temp_World;
 	}
 
 
-	// should always pass a full-sized float world to write into (using options we pass)
-	err = OpenEXR_DrawSparseFrame(basic_dataP, sparse_framePPB, active_World,
+	// AE's required region is in the coordinates of the world it gave us,
+	// so scale it up if we're using a bigger world (plus a pixel for the downsample)
+	AEIO_DrawSparseFramePB sparse_frame;
+	A_LRect required_region;
+	
+	const AEIO_DrawSparseFramePB *active_sparse_frame = sparse_framePPB;
+	
+	if(sparse_framePPB && sparse_framePPB->required_region0 &&
+		(world_width != wP->width || world_height != wP->height) )
+	{
+		const A_LRect &region = *sparse_framePPB->required_region0;
+		
+		required_region.left	= MAX(0, ((region.left * world_width) / wP->width) - 1);
+		required_region.top		= MAX(0, ((region.top * world_height) / wP->height) - 1);
+		required_region.right	= MIN(world_width, ((region.right * world_width + wP->width - 1) / wP->width) + 1);
+		required_region.bottom	= MIN(world_height, ((region.bottom * world_height + wP->height - 1) / wP->height) + 1);
+		
+		sparse_frame = *sparse_framePPB;
+		sparse_frame.required_region0 = &required_region;
+		
+		active_sparse_frame = &sparse_frame;
+	}
+	
+
+	// pass a float world to write into (using options we pass), either full-sized or scaled down
+	err = OpenEXR_DrawSparseFrame(basic_dataP, active_sparse_frame, scale, active_World,
 									draw_flagsP, file_nameZ, &info, options);
 
-	
 
 	if(temp_World)
 	{
@@ -1767,6 +1812,16 @@ FrameSeq_OutputFrame(
 }
 
 
+A_Err	
+FrameSeq_FinishOutput(
+	AEIO_BasicData	*basic_dataP,
+	AEIO_OutSpecH			outH)
+{
+	// frames might still be getting written in the background
+	return OpenEXR_FinishOutput(basic_dataP);
+}
+
+
 A_Err	
 FrameSeq_UserOptionsDialog(
 	AEIO_BasicData		*basic_dataP,
@@ -220,6 +220,11 @@ FrameSeq_OutputFrame(
 	AEIO_OutSpecH			outH, 
 	const PF_EffectWorld	*wP);
 
+A_Err	
+FrameSeq_FinishOutput(
+	AEIO_BasicData	*basic_dataP,
+	AEIO_OutSpecH			outH);
+
 A_Err	
 FrameSeq_UserOptionsDialog(
 	AEIO_BasicData		*basic_dataP,
@@ -9,41 +9,87 @@
 
 #include "ImfHybridInputFile.h"
 
-#include "ImfInputPart.h"
 #include "ImfPartType.h"
+#include "ImfVersion.h"
+#include "ImfXdr.h"
+#include "ImfStdIO.h"
+#include "ImfThreading.h"
 
 #include "Iex.h"
 
+#include <IlmThread.h>
+#include <IlmThreadMutex.h>
+#include <IlmThreadPool.h>
+
+#include <half.h>
+
+#include <vector>
+#include <assert.h>
+
 
 OPENEXR_IMF_INTERNAL_NAMESPACE_SOURCE_ENTER
 
 
 using namespace std;
 using IMATH_NAMESPACE::Box2i;
+using IMATH_NAMESPACE::V2i;
+using ILMTHREAD_NAMESPACE::Mutex;
+using ILMTHREAD_NAMESPACE::Lock;
 
 
 HybridInputFile::HybridInputFile(const char fileName[], bool renameFirstPart, int numThreads, bool reconstructChunkOffsetTable) :
-	_multiPart(fileName, numThreads, reconstructChunkOffsetTable),
-	_renameFirstPart(renameFirstPart)
+	_fileStream(new StdIFStream(fileName)),
+	_is(*_fileStream),
+	_headers(_is, renameFirstPart),
+	_multiPart(NULL),
+	_renameFirstPart(renameFirstPart),
+	_numThreads(numThreads),
+	_reconstructChunkOffsetTable(reconstructChunkOffsetTable),
+	_streamSource(NULL),
+	_maxStreams(1)
 {
 	setup();
 }
 
 
 HybridInputFile::HybridInputFile(IStream& is, bool renameFirstPart, int numThreads, bool reconstructChunkOffsetTable) :
-	_multiPart(is, numThreads, reconstructChunkOffsetTable),
-	_renameFirstPart(renameFirstPart)
+	_is(is),
+	_headers(_is, renameFirstPart),
+	_multiPart(NULL),
+	_renameFirstPart(renameFirstPart),
+	_numThreads(numThreads),
+	_reconstructChunkOffsetTable(reconstructChunkOffsetTable),
+	_streamSource(NULL),
+	_maxStreams(1)
 {
 	setup();
 }
 
 
+HybridInputFile::~HybridInputFile()
+{
+	for(vector<InputPart *>::iterator i = _inputParts.begin(); i != _inputParts.end(); ++i)
+		delete *i;
+	
+	for(vector<TiledInputPart *>::iterator i = _tiledParts.begin(); i != _tiledParts.end(); ++i)
+		delete *i;
+	
+	for(vector<MultiPartInputFile *>::iterator i = _extraFiles.begin(); i != _extraFiles.end(); ++i)
+		delete *i;
+	
+	for(vector<IStream *>::iterator i = _extraStreams.begin(); i != _extraStreams.end(); ++i)
+		delete *i;
+	
+	delete _multiPart;
+}
+
+
 bool
 HybridInputFile::isComplete() const
 {
-	for(int i=0; i < _multiPart.parts(); i++)
+	for(int i=0; i < parts(); i++)
 	{
-		if( !_multiPart.partComplete(i) )
+		if( !multiPart().partComplete(i) )
 			return false;
 	}
 	
@@ -51,61 +97,748 @@ HybridInputFile::isComplete() const
 }
 
 
+void
+HybridInputFile::setFrameBuffer(const FrameBuffer &frameBuffer)
+{
+	_frameBuffer = frameBuffer;
+	
+	
+	// route each channel to its part, once
+	vector<FrameBuffer> part_fbs( parts() );
+	
+	for(FrameBuffer::ConstIterator i = _frameBuffer.begin(); i != _frameBuffer.end(); i++)
+	{
+		HybridChannelMap::const_iterator hyChan = _map.find( i.name() );
+		
+		if(hyChan != _map.end())
+		{
+			part_fbs[hyChan->second.part].insert( hyChan->second.name, i.slice() );
+		}
+		else
+		{
+			// for channels that will be simply be filled
+			const bool rename = (parts() > 1);
+			
+			const string name_never_loaded = (rename ? string("zzNOLOADzz") + i.name() : i.name());
+			
+			part_fbs[0].insert( name_never_loaded, i.slice() );
+		}
+	}
+	
+	
+	_plan.clear();
+	
+	for(int n=0; n < parts(); n++)
+	{
+		if(part_fbs[n].begin() != part_fbs[n].end()) // i.e. it's not empty
+		{
+			PartPlan plan;
+			
+			plan.part = n;
+			plan.tiled = header(n).hasTileDescription();
+			plan.frameBuffer = part_fbs[n];
+			plan.frameBufferSet = false;
+			
+			_plan.push_back(plan);
+		}
+	}
+}
+
+
+InputPart &
+HybridInputFile::inputPart(int n)
+{
+	if(_inputParts[n] == NULL)
+		_inputParts[n] = new InputPart(multiPart(), n);
+	
+	return *_inputParts[n];
+}
+
+
+TiledInputPart &
+HybridInputFile::tiledPart(int n)
+{
+	if(_tiledParts[n] == NULL)
+		_tiledParts[n] = new TiledInputPart(multiPart(), n);
+	
+	return *_tiledParts[n];
+}
+
+
 void
 HybridInputFile::readPixels(int scanLine1, int scanLine2)
 {
-	for(int n=0; n < _multiPart.parts(); n++)
+	readRegion( Box2i(V2i(dataWindow().min.x, scanLine1), V2i(dataWindow().max.x, scanLine2)) );
+}
+
+
+struct HybridInputFile::PartRead
+{
+	PartPlan *plan;
+	Box2i region;
+	
+	PartRead(PartPlan *p, const Box2i &r) : plan(p), region(r) {}
+};
+
+
+void
+HybridInputFile::readRegion(const Box2i &region, int lx, int ly)
+{
+	vector<PartRead> partReads;
+	
+	for(vector<PartPlan>::iterator plan = _plan.begin(); plan != _plan.end(); ++plan)
 	{
-		FrameBuffer part_fb;
+		const bool level0 = (lx == 0 && ly == 0);
+		
+		if(!level0 && !plan->tiled)
+			throw IEX_NAMESPACE::ArgExc("Scanline parts only have one level");
+		
+		const Box2i dataW = (level0 ? header(plan->part).dataWindow() : tiledPart(plan->part).dataWindowForLevel(lx, ly));
+		
+		const Box2i partRegion(V2i(max(region.min.x, dataW.min.x), max(region.min.y, dataW.min.y)),
+								V2i(min(region.max.x, dataW.max.x), min(region.max.y, dataW.max.y)));
+		
+		if(partRegion.max.x >= partRegion.min.x && partRegion.max.y >= partRegion.min.y)
+		{
+			partReads.push_back( PartRead(&*plan, partRegion) );
+		}
+	}
+	
 	
-		for(FrameBuffer::ConstIterator i = _frameBuffer.begin(); i != _frameBuffer.end(); i++)
+	if(_streamSource != NULL && _maxStreams > 1 && !partReads.empty() && partReads.size() < (size_t)_maxStreams)
+	{
+		// not enough parts to go around, so readers get bands of the same part
+		splitPartReads(partReads, (_maxStreams + partReads.size() - 1) / partReads.size());
+	}
+	
+	const int streams = min<int>(_maxStreams, partReads.size());
+	
+	if(_streamSource != NULL && streams > 1)
+	{
+		readPartsParallel(partReads, streams, lx, ly);
+	}
+	else
+	{
+		for(vector<PartRead>::const_iterator i = partReads.begin(); i != partReads.end(); ++i)
 		{
-			if( _map.find( i.name() ) != _map.end() )
-			{
-				const HybridChannel &hyChan = _map[ i.name() ];
-				
-				if(hyChan.part == n)
-				{
-					part_fb.insert( hyChan.name, i.slice() );
-				}
-			}
-			else if(n == 0)
+			readPart(multiPart(), *i, lx, ly);
+		}
+	}
+}
+
+
+int
+HybridInputFile::chunkRows(const PartRead &partRead)
+{
+	const Header &head = header(partRead.plan->part);
+	
+	if(partRead.plan->tiled)
+		return head.tileDescription().ySize;
+	
+	switch( head.compression() )
+	{
+		case ZIP_COMPRESSION:
+		case PXR24_COMPRESSION:
+			return 16;
+		
+		case PIZ_COMPRESSION:
+		case B44_COMPRESSION:
+		case B44A_COMPRESSION:
+		case DWAA_COMPRESSION:
+			return 32;
+		
+		case DWAB_COMPRESSION:
+			return 256;
+		
+		default:
+			return 1;
+	}
+}
+
+
+void
+HybridInputFile::splitPartReads(vector<PartRead> &partReads, int bands)
+{
+	vector<PartRead> bandReads;
+	
+	for(vector<PartRead>::const_iterator i = partReads.begin(); i != partReads.end(); ++i)
+	{
+		const Box2i &region = i->region;
+		
+		// bands start on chunk boundaries so two readers don't decode the same chunk,
+		// lines and tiles both start counting at the top of the data window
+		const int chunk = chunkRows(*i);
+		const int origin = header(i->plan->part).dataWindow().min.y;
+		
+		const int rows = region.max.y - region.min.y + 1;
+		
+		int band_rows = (rows + bands - 1) / bands;
+		
+		band_rows = ((band_rows + chunk - 1) / chunk) * chunk;
+		
+		int y = region.min.y;
+		
+		while(y <= region.max.y)
+		{
+			const int band_end = min(origin + (((y - origin) + band_rows) / chunk) * chunk - 1, region.max.y);
+			
+			bandReads.push_back( PartRead(i->plan, Box2i(V2i(region.min.x, y), V2i(region.max.x, band_end))) );
+			
+			y = band_end + 1;
+		}
+	}
+	
+	partReads.swap(bandReads);
+}
+
+
+void
+HybridInputFile::readPart(MultiPartInputFile &file, const PartRead &partRead, int lx, int ly)
+{
+	PartPlan &plan = *partRead.plan;
+	
+	// tiled parts always go through TiledInputPart, MultiPartInputFile
+	// doesn't like being asked for the same part as two different types
+	if(&file == _multiPart)
+	{
+		if(plan.tiled)
+		{
+			readTiledPart(tiledPart(plan.part), plan.frameBuffer, plan.frameBufferSet, partRead.region, lx, ly);
+		}
+		else
+		{
+			InputPart &inPart = inputPart(plan.part);
+			
+			if(!plan.frameBufferSet)
 			{
-				// for channels that will be simply be filled
-				const bool rename = (_multiPart.parts() > 1);
-				
-				const string name_never_loaded = (rename ? string("zzNOLOADzz") + i.name() : i.name());
+				inPart.setFrameBuffer(plan.frameBuffer);
 				
-				part_fb.insert( name_never_loaded, i.slice() );
+				plan.frameBufferSet = true;
 			}
+			
+			inPart.readPixels(partRead.region.min.y, partRead.region.max.y);
+		}
+	}
+	else
+	{
+		// one of the extra files in readPartsParallel()
+		bool frameBufferSet = false;
+		
+		if(plan.tiled)
+		{
+			TiledInputPart inPart(file, plan.part);
+			
+			readTiledPart(inPart, plan.frameBuffer, frameBufferSet, partRead.region, lx, ly);
+		}
+		else
+		{
+			InputPart inPart(file, plan.part);
+			
+			inPart.setFrameBuffer(plan.frameBuffer);
+			
+			inPart.readPixels(partRead.region.min.y, partRead.region.max.y);
+		}
+	}
+}
+
+
+void
+HybridInputFile::setParallelParts(HybridStreamSource *source, int maxStreams)
+{
+	if(source != _streamSource)
+	{
+		// extra files came from the old source, so close them
+		for(vector<MultiPartInputFile *>::iterator i = _extraFiles.begin(); i != _extraFiles.end(); ++i)
+			delete *i;
+		
+		for(vector<IStream *>::iterator i = _extraStreams.begin(); i != _extraStreams.end(); ++i)
+			delete *i;
+		
+		_extraFiles.clear();
+		_extraStreams.clear();
+	}
+	
+	_streamSource = source;
+	_maxStreams = max(maxStreams, 1);
+}
+
+
+// parts waiting to be read, shared by all the readers
+struct HybridInputFile::PartQueue
+{
+	const vector<PartRead> &partReads;
+	const int lx, ly;
+	
+	// the first error, keeping its type so callers can still tell
+	// a damaged file (that they can draw partially) from other trouble
+	enum ErrorType { NoError, IoError, InputError, OtherError };
+	
+	Mutex mutex;
+	size_t next;
+	ErrorType errorType;
+	string error;
+	
+	PartQueue(const vector<PartRead> &p, int x, int y) : partReads(p), lx(x), ly(y), next(0), errorType(NoError) {}
+	
+	void setError(ErrorType type, const char *what);
+	void throwError() const;
+};
+
+
+void
+HybridInputFile::PartQueue::setError(ErrorType type, const char *what)
+{
+	Lock lock(mutex);
+	
+	if(errorType == NoError)
+	{
+		errorType = type;
+		error = what;
+	}
+}
+
+
+void
+HybridInputFile::PartQueue::throwError() const
+{
+	switch(errorType)
+	{
+		case NoError:
+			break;
+		
+		case IoError:
+			throw IEX_NAMESPACE::IoExc(error);
+		
+		case InputError:
+			throw IEX_NAMESPACE::InputExc(error);
+		
+		default:
+			throw IEX_NAMESPACE::BaseExc(error);
+	}
+}
+
+
+class HybridInputFile::PartReader : public ILMTHREAD_NAMESPACE::Task
+{
+  public:
+	PartReader(ILMTHREAD_NAMESPACE::TaskGroup *group, HybridInputFile &in, MultiPartInputFile &file, PartQueue &queue) :
+		ILMTHREAD_NAMESPACE::Task(group), _in(in), _file(file), _queue(queue) {}
+	virtual ~PartReader() {}
+	
+	virtual void execute();
+	
+  private:
+	HybridInputFile &_in;
+	MultiPartInputFile &_file;
+	PartQueue &_queue;
+};
+
+
+void
+HybridInputFile::PartReader::execute()
+{
+	_in.readQueue(_file, _queue);
+}
+
+
+void
+HybridInputFile::readQueue(MultiPartInputFile &file, PartQueue &queue)
+{
+	// Keeps going after an error, so the good parts still get read
+	while(true)
+	{
+		size_t i;
+		
+		{
+			Lock lock(queue.mutex);
+			
+			if(queue.next >= queue.partReads.size())
+				return;
+			
+			i = queue.next++;
 		}
 		
-		if(part_fb.begin() != part_fb.end()) // i.e. it's not empty
+		try
+		{
+			readPart(file, queue.partReads[i], queue.lx, queue.ly);
+		}
+		catch(const IEX_NAMESPACE::IoExc &e)
+		{
+			queue.setError(PartQueue::IoError, e.what());
+		}
+		catch(const IEX_NAMESPACE::InputExc &e)
+		{
+			queue.setError(PartQueue::InputError, e.what());
+		}
+		catch(const std::exception &e)
+		{
+			queue.setError(PartQueue::OtherError, e.what());
+		}
+		catch(...)
+		{
+			queue.setError(PartQueue::OtherError, "Unknown error reading part.");
+		}
+	}
+}
+
+
+void
+HybridInputFile::readPartsParallel(const vector<PartRead> &partReads, int streams, int lx, int ly)
+{
+	// no more readers than the threads OpenEXR has been given,
+	// which is none when threads aren't supported or are turned off
+	streams = min(streams, globalThreadCount());
+	
+	if(streams <= 1)
+	{
+		for(vector<PartRead>::const_iterator i = partReads.begin(); i != partReads.end(); ++i)
 		{
-			const Box2i &dataW = _multiPart.header(n).dataWindow();
+			readPart(multiPart(), *i, lx, ly);
+		}
+		
+		return;
+	}
+	
+	// each extra reader gets its own file, opened once and kept for later reads
+	while((int)_extraFiles.size() < streams - 1)
+	{
+		IStream *stream = _streamSource->newStream();
+		
+		if(stream == NULL)
+			break;
+		
+		_extraStreams.push_back(stream);
+		
+		_extraFiles.push_back( new MultiPartInputFile(*stream, _numThreads, _reconstructChunkOffsetTable) );
+	}
+	
+	
+	const int readers = min<int>(_extraFiles.size(), streams - 1);
+	
+	if(_readerPool.get() == NULL)
+		_readerPool.reset( new ILMTHREAD_NAMESPACE::ThreadPool(readers) );
+	else if(_readerPool->numThreads() < readers)
+		_readerPool->setNumThreads(readers);
+	
+	
+	PartQueue queue(partReads, lx, ly);
+	
+	if(true) // making a scope for TaskGroup, which waits for the readers
+	{
+		ILMTHREAD_NAMESPACE::TaskGroup group;
+		
+		for(int i=0; i < readers; i++)
+		{
+			_readerPool->addTask( new PartReader(&group, *this, *_extraFiles[i], queue) );
+		}
+		
+		// this thread is a reader too
+		readQueue(multiPart(), queue);
+	}
+	
+	queue.throwError();
+}
+
+
+bool
+HybridInputFile::isValidLevel(int lx, int ly)
+{
+	if(lx == 0 && ly == 0)
+		return true;
+	
+	bool found_part = false;
+	
+	Box2i levelW;
+	
+	for(int n=0; n < parts(); n++)
+	{
+		const Header &head = header(n);
+		
+		if(head.type() != OPENEXR_IMF_INTERNAL_NAMESPACE::DEEPTILE)
+		{
+			if( !head.hasTileDescription() )
+				return false;
+			
+			TiledInputPart &inPart = tiledPart(n);
+			
+			if( !inPart.isValidLevel(lx, ly) )
+				return false;
+			
+			// parts with different dataWindows would have levels that don't line up
+			if(found_part && inPart.dataWindowForLevel(lx, ly) != levelW)
+				return false;
+			
+			levelW = inPart.dataWindowForLevel(lx, ly);
+			
+			found_part = true;
+		}
+	}
+	
+	return found_part;
+}
+
+
+Box2i
+HybridInputFile::dataWindowForLevel(int lx, int ly)
+{
+	if(lx == 0 && ly == 0)
+		return dataWindow();
+	
+	if( !isValidLevel(lx, ly) )
+		throw IEX_NAMESPACE::ArgExc("Level is not available in every part");
+	
+	for(int n=0; n < parts(); n++)
+	{
+		if(header(n).type() != OPENEXR_IMF_INTERNAL_NAMESPACE::DEEPTILE)
+			return tiledPart(n).dataWindowForLevel(lx, ly);
+	}
+	
+	return dataWindow();
+}
+
+
+void
+HybridInputFile::readTiledPart(TiledInputPart &inPart, const FrameBuffer &part_fb, bool &frameBufferSet,
+								const Box2i &region, int lx, int ly)
+{
+	const Box2i dataW = inPart.dataWindowForLevel(lx, ly);
+	
+	const int tileW = inPart.tileXSize();
+	const int tileH = inPart.tileYSize();
+	
+	// range of tiles touched by the region
+	const int tx1 = (region.min.x - dataW.min.x) / tileW;
+	const int tx2 = (region.max.x - dataW.min.x) / tileW;
+	const int ty1 = (region.min.y - dataW.min.y) / tileH;
+	const int ty2 = (region.max.y - dataW.min.y) / tileH;
+	
+	// range of tiles that lie entirely inside the region
+	const int ix1 = (inPart.dataWindowForTile(tx1, ty1, lx, ly).min.x < region.min.x ? tx1 + 1 : tx1);
+	const int ix2 = (inPart.dataWindowForTile(tx2, ty2, lx, ly).max.x > region.max.x ? tx2 - 1 : tx2);
+	const int iy1 = (inPart.dataWindowForTile(tx1, ty1, lx, ly).min.y < region.min.y ? ty1 + 1 : ty1);
+	const int iy2 = (inPart.dataWindowForTile(tx2, ty2, lx, ly).max.y > region.max.y ? ty2 - 1 : ty2);
+	
+	if(ix1 > ix2 || iy1 > iy2)
+	{
+		readTilesThroughScratch(inPart, part_fb, tx1, tx2, ty1, ty2, lx, ly, region);
+		
+		frameBufferSet = false;
+	}
+	else
+	{
+		// whole tiles can go straight into the frame buffer
+		if(!frameBufferSet)
+		{
+			inPart.setFrameBuffer(part_fb);
 			
-			const int startScanline = max(scanLine1, dataW.min.y);
-			const int endScanline = min(scanLine2, dataW.max.y);
+			frameBufferSet = true;
+		}
+		
+		inPart.readTiles(ix1, ix2, iy1, iy2, lx, ly);
+		
+		// the tiles around the edge would write outside the region
+		if(ty1 < iy1)
+			readTilesThroughScratch(inPart, part_fb, tx1, tx2, ty1, iy1 - 1, lx, ly, region);
+		
+		if(iy2 < ty2)
+			readTilesThroughScratch(inPart, part_fb, tx1, tx2, iy2 + 1, ty2, lx, ly, region);
+		
+		if(tx1 < ix1)
+			readTilesThroughScratch(inPart, part_fb, tx1, ix1 - 1, iy1, iy2, lx, ly, region);
+		
+		if(ix2 < tx2)
+			readTilesThroughScratch(inPart, part_fb, ix2 + 1, tx2, iy1, iy2, lx, ly, region);
+		
+		// scratch reads leave the part with their own frame buffer
+		if(ty1 < iy1 || iy2 < ty2 || tx1 < ix1 || ix2 < tx2)
+			frameBufferSet = false;
+	}
+}
+
+
+static size_t
+PixelSize(PixelType type)
+{
+	return (type == OPENEXR_IMF_INTERNAL_NAMESPACE::HALF ? sizeof(half) :
+			type == OPENEXR_IMF_INTERNAL_NAMESPACE::FLOAT ? sizeof(float) :
+			sizeof(unsigned int));
+}
+
+
+void
+HybridInputFile::readTilesThroughScratch(TiledInputPart &inPart, const FrameBuffer &part_fb,
+											int tx1, int tx2, int ty1, int ty2, int lx, int ly,
+											const Box2i &region)
+{
+	const Box2i tileBox(inPart.dataWindowForTile(tx1, ty1, lx, ly).min, inPart.dataWindowForTile(tx2, ty2, lx, ly).max);
+	
+	const int width = (tileBox.max.x - tileBox.min.x) + 1;
+	const int height = (tileBox.max.y - tileBox.min.y) + 1;
+	
+	
+	size_t scratch_size = 0;
+	
+	for(FrameBuffer::ConstIterator i = part_fb.begin(); i != part_fb.end(); i++)
+	{
+		scratch_size += PixelSize(i.slice().type) * width * height;
+	}
+	
+	vector<char> scratch(scratch_size);
+	
+	
+	FrameBuffer scratch_fb;
+	
+	size_t offset = 0;
+	
+	for(FrameBuffer::ConstIterator i = part_fb.begin(); i != part_fb.end(); i++)
+	{
+		const Slice &slice = i.slice();
+		
+		const size_t pix_size = PixelSize(slice.type);
+		const size_t rowbytes = pix_size * width;
+		
+		char *origin = &scratch[offset] - (pix_size * tileBox.min.x) - (rowbytes * tileBox.min.y);
+		
+		scratch_fb.insert(i.name(), Slice(slice.type, origin, pix_size, rowbytes, 1, 1, slice.fillValue));
+		
+		offset += rowbytes * height;
+	}
+	
+	inPart.setFrameBuffer(scratch_fb);
+	
+	inPart.readTiles(tx1, tx2, ty1, ty2, lx, ly);
+	
+	
+	// now copy just the pixels inside the region
+	const Box2i copyBox(V2i(max(region.min.x, tileBox.min.x), max(region.min.y, tileBox.min.y)),
+						V2i(min(region.max.x, tileBox.max.x), min(region.max.y, tileBox.max.y)));
+	
+	for(FrameBuffer::ConstIterator i = scratch_fb.begin(); i != scratch_fb.end(); i++)
+	{
+		const Slice &in_slice = i.slice();
+		const Slice *out_slice = part_fb.findSlice( i.name() );
+		
+		assert(out_slice != NULL && out_slice->type == in_slice.type);
+		
+		const size_t pix_size = PixelSize(in_slice.type);
+		
+		for(int y = copyBox.min.y; y <= copyBox.max.y; y++)
+		{
+			const char *in_pix = in_slice.base + (in_slice.yStride * y) + (in_slice.xStride * copyBox.min.x);
+			char *out_pix = out_slice->base + (out_slice->yStride * y) + (out_slice->xStride * copyBox.min.x);
 			
-			if(endScanline >= startScanline)
+			for(int x = copyBox.min.x; x <= copyBox.max.x; x++)
 			{
-				InputPart inPart(_multiPart, n);
-				
-				inPart.setFrameBuffer(part_fb);
+				memcpy(out_pix, in_pix, pix_size);
 				
-				inPart.readPixels(startScanline, endScanline);
+				in_pix += in_slice.xStride;
+				out_pix += out_slice->xStride;
 			}
 		}
 	}
 }
 
 
+// Channels from parts after the first get the part name in front.
+// With renameFirstPart, the first part's channels do too.
+static string
+HybridChannelName(const Header &head, int part, int parts, bool renameFirstPart, const char *name)
+{
+	const bool rename = (parts > 1) && (part > 0 || renameFirstPart) && head.hasName();
+	
+	return (rename ? head.name() + "." + name : string(name));
+}
+
+
 void
 HybridInputFile::setup()
 {
-	for(int n=0; n < _multiPart.parts(); n++)
+	_inputParts.assign(parts(), (InputPart *)NULL);
+	_tiledParts.assign(parts(), (TiledInputPart *)NULL);
+	
+	for(int n=0; n < parts(); n++)
 	{
-		const Header &head = _multiPart.header(n);
+		const Header &head = header(n);
+		
+		if(head.type() != OPENEXR_IMF_INTERNAL_NAMESPACE::DEEPTILE)
+		{
+			const ChannelList &chans = head.channels();
+
+			for(ChannelList::ConstIterator i = chans.begin(); i != chans.end(); ++i)
+			{
+				const string hybrid_name = HybridChannelName(head, n, parts(), _renameFirstPart, i.name());
+				
+				_map[ hybrid_name ] = HybridChannel(n, i.name());
+			}
+		}
+	}
+}
+
+
+MultiPartInputFile &
+HybridInputFile::multiPart() const
+{
+	if(_multiPart == NULL)
+	{
+		_is.seekg(0); // HybridHeaders already read from it
+		
+		_multiPart = new MultiPartInputFile(_is, _numThreads, _reconstructChunkOffsetTable);
+	}
+	
+	return *_multiPart;
+}
+
+
+HybridHeaders::HybridHeaders(IStream& is, bool renameFirstPart) :
+	_version(0)
+{
+	// read the headers the way MultiPartInputFile does, but stop before the offset tables
+	int magic = 0;
+	
+	Xdr::read<StreamIO>(is, magic);
+	Xdr::read<StreamIO>(is, _version);
+	
+	if(magic != MAGIC)
+		throw IEX_NAMESPACE::InputExc("File is not an image file.");
+	
+	if(getVersion(_version) != EXR_VERSION)
+		throw IEX_NAMESPACE::InputExc("Cannot read version of this file.");
+	
+	const bool multipart = isMultiPart(_version);
+	
+	if(multipart)
+	{
+		while(true)
+		{
+			Header head;
+			
+			head.readFrom(is, _version);
+			
+			if( head.readsNothing() ) // an empty header ends the list
+				break;
+			
+			_headers.push_back(head);
+		}
+	}
+	else
+	{
+		_headers.push_back( Header() );
+		
+		_headers[0].readFrom(is, _version);
+		
+		if( !_headers[0].hasType() )
+			_headers[0].setType(isTiled(_version) ? TILEDIMAGE : SCANLINEIMAGE);
+	}
+	
+	if( _headers.empty() )
+		throw IEX_NAMESPACE::InputExc("File has no parts.");
+	
+	
+	for(int n=0; n < parts(); n++)
+	{
+		const Header &head = _headers[n];
+		
+		head.sanityCheck(isTiled(head.type()), multipart);
 		
 		if(head.type() != OPENEXR_IMF_INTERNAL_NAMESPACE::DEEPTILE)
 		{
@@ -117,16 +850,10 @@ HybridInputFile::setup()
 			
 			
 			const ChannelList &chans = head.channels();
-
+			
 			for(ChannelList::ConstIterator i = chans.begin(); i != chans.end(); ++i)
 			{
-				const bool rename = (_multiPart.parts() > 1) && (n > 0 || _renameFirstPart) && head.hasName();
-				
-				const string hybrid_name = (rename ? head.name() + "." + i.name() : i.name());
-				
-				_map[ hybrid_name ] = HybridChannel(n, i.name());
-				
-				_chanList.insert(hybrid_name, i.channel());
+				_chanList.insert(HybridChannelName(head, n, parts(), renameFirstPart, i.name()), i.channel());
 			}
 		}
 	}
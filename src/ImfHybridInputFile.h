@@ -12,14 +12,66 @@
 
 #include "ImfHeader.h"
 #include "ImfMultiPartInputFile.h"
+#include "ImfInputPart.h"
+#include "ImfTiledInputPart.h"
 #include "ImfFrameBuffer.h"
 #include "ImfChannelList.h"
 #include "ImathBox.h"
 
+#include <IlmThreadPool.h>
+
+#include <vector>
+#include <memory>
+
 
 OPENEXR_IMF_INTERNAL_NAMESPACE_HEADER_ENTER
 
 
+// A MultiPartInputFile only reads one chunk at a time, so to decode parts
+// (or bands of a part) side by side HybridInputFile needs more streams on the
+// same file.  They're used from different threads, so they should be able to
+// read without going through a shared file position.
+class IMF_EXPORT HybridStreamSource
+{
+  public:
+	virtual ~HybridStreamSource() {}
+	
+	virtual IStream * newStream() = 0; // HybridInputFile deletes it
+};
+
+
+// Reads only the headers, so it never touches the chunk offset tables.  For when
+// all you want to know is what's in the file.  Channels get the same names
+// they'd have in a HybridInputFile.
+class IMF_EXPORT HybridHeaders
+{
+  public:
+	HybridHeaders(IStream& is, bool renameFirstPart = false);
+	
+	
+	int parts() const { return _headers.size(); }
+	
+	const Header &  header(int n) const { return _headers[n]; }
+	
+	int			    version () const { return _version; }
+	
+	const ChannelList &		channels () const { return _chanList; }
+	
+	const IMATH_NAMESPACE::Box2i & dataWindow() const { return _dataWindow; }
+	const IMATH_NAMESPACE::Box2i & displayWindow() const { return _displayWindow; }
+
+  private:
+	std::vector<Header> _headers;
+	
+	int _version;
+	
+	IMATH_NAMESPACE::Box2i _dataWindow;
+	IMATH_NAMESPACE::Box2i _displayWindow;
+	
+	ChannelList _chanList;
+};
+
+
 class IMF_EXPORT HybridInputFile : public GenericInputFile
 {
   public:
@@ -31,43 +83,111 @@ class IMF_EXPORT HybridInputFile : public GenericInputFile
 					int numThreads = globalThreadCount(),
 					bool reconstructChunkOffsetTable = true);
 
-	virtual ~HybridInputFile() {}
+	virtual ~HybridInputFile();
 	
 	
-	int parts() const { return _multiPart.parts(); }
+	int parts() const { return _headers.parts(); }
 
-	const Header &  header(int n) const { return _multiPart.header(n); }
+	const Header &  header(int n) const { return _headers.header(n); }
 	
-	int			    version () const { return _multiPart.version(); }
+	int			    version () const { return _headers.version(); }
 	
 	bool		isComplete () const;
 	
-	const ChannelList &		channels () const { return _chanList; }
+	const ChannelList &		channels () const { return _headers.channels(); }
 	
-	const IMATH_NAMESPACE::Box2i & dataWindow() const { return _dataWindow; }
-	const IMATH_NAMESPACE::Box2i & displayWindow() const { return _displayWindow; }
+	const IMATH_NAMESPACE::Box2i & dataWindow() const { return _headers.dataWindow(); }
+	const IMATH_NAMESPACE::Box2i & displayWindow() const { return _headers.displayWindow(); }
 	
 	
-	void		setFrameBuffer (const FrameBuffer &frameBuffer) { _frameBuffer = frameBuffer; }
+	void		setFrameBuffer (const FrameBuffer &frameBuffer);
 	
 	const FrameBuffer &	frameBuffer () const { return _frameBuffer; }
 	
     void		readPixels (int scanLine1, int scanLine2);
     void		readPixels (int scanLine) { readPixels(scanLine, scanLine); }
 	
+	// Only decodes the chunks that intersect the region.  Scanline parts
+	// still write entire lines, tiled parts only write inside the region.
+	// Levels other than 0 are in the coordinates of dataWindowForLevel().
+	void		readRegion (const IMATH_NAMESPACE::Box2i &region, int lx = 0, int ly = 0);
+	
+	// true if every part is tiled with this mip/rip-map level and the levels line up
+	bool		isValidLevel (int lx, int ly);
+	
+	IMATH_NAMESPACE::Box2i dataWindowForLevel (int lx, int ly);
+	
+	// With a stream source, up to maxStreams parts are decoded at once.  If there
+	// are fewer parts than that, parts are split into bands and those go at once.
+	// The source has to stay around until it's replaced (NULL is fine).
+	void		setParallelParts (HybridStreamSource *source, int maxStreams);
+	
   private:
 	void setup();
+	
+	MultiPartInputFile & multiPart() const;
+	
+	InputPart & inputPart(int n);
+	TiledInputPart & tiledPart(int n);
+	
+	struct PartRead;
+	struct PartQueue;
+	class PartReader;
+	
+	int chunkRows(const PartRead &partRead);
+	void splitPartReads(std::vector<PartRead> &partReads, int bands);
+	
+	void readPart(MultiPartInputFile &file, const PartRead &partRead, int lx, int ly);
+	void readPartsParallel(const std::vector<PartRead> &partReads, int streams, int lx, int ly);
+	void readQueue(MultiPartInputFile &file, PartQueue &queue);
+	
+	void readTiledPart(TiledInputPart &inPart, const FrameBuffer &part_fb, bool &frameBufferSet,
+						const IMATH_NAMESPACE::Box2i &region, int lx, int ly);
+	void readTilesThroughScratch(TiledInputPart &inPart, const FrameBuffer &part_fb,
+									int tx1, int tx2, int ty1, int ty2, int lx, int ly,
+									const IMATH_NAMESPACE::Box2i &region);
 
   private:
-	MultiPartInputFile _multiPart;
+	std::auto_ptr<IStream> _fileStream; // if we opened the file ourselves
+	IStream &_is;
+	
+	HybridHeaders _headers;
+	
+	// Opening it reads the chunk offset tables of every part, so
+	// that waits until some pixels are actually wanted.
+	mutable MultiPartInputFile *_multiPart;
 	
 	const bool _renameFirstPart;
+	const int _numThreads;
+	const bool _reconstructChunkOffsetTable;
 	
-	IMATH_NAMESPACE::Box2i _dataWindow;
-	IMATH_NAMESPACE::Box2i _displayWindow;
+	HybridStreamSource *_streamSource;
+	int _maxStreams;
+	
+	std::vector<IStream *> _extraStreams;
+	std::vector<MultiPartInputFile *> _extraFiles;
+	
+	// Threads for the extra readers.  They wait on OpenEXR's line and tile tasks,
+	// which go in the global pool, so they can't be in that pool themselves.
+	std::auto_ptr<ILMTHREAD_NAMESPACE::ThreadPool> _readerPool;
 	
 	FrameBuffer		_frameBuffer;
 	
+	// Made by setFrameBuffer(), so band reads don't have to route
+	// every channel to its part and set up the parts each time.
+	typedef struct PartPlan {
+		int part;
+		bool tiled;
+		FrameBuffer frameBuffer;
+		bool frameBufferSet; // our part in _multiPart already has it
+	} PartPlan;
+	
+	std::vector<PartPlan> _plan;
+	
+	// kept for the life of the file, made when first needed
+	std::vector<InputPart *> _inputParts;
+	std::vector<TiledInputPart *> _tiledParts;
+	
 	typedef struct HybridChannel {
 		int part;
 		std::string name;
@@ -78,8 +198,6 @@ class IMF_EXPORT HybridInputFile : public GenericInputFile
 	typedef std::map<std::string, HybridChannel> HybridChannelMap;
 	
 	HybridChannelMap _map;
-	
-	ChannelList _chanList;
 };
 
 
@@ -17,8 +17,6 @@
 //
 //	ToDo in this module:
 //
-//	Option to save with other resolutions included, maybe read them when advantageous
-//	Save as tiles instead of always scanline
 //	Create/use preview images
 //	Handle other metadata I might be missing (?)
 //
@@ -38,11 +36,14 @@
 #include "OpenEXR_UI.h"
 #include "OpenEXR_ChannelMap.h"
 #include "OpenEXR_ChannelCache.h"
+#include "OpenEXR_FileCache.h"
 #include "OpenEXR_iccProfileAttribute.h"
+#include "OpenEXR_SIMD.h"
 
 
 #include "ImfHybridInputFile.h"
 #include <ImfOutputFile.h>
+#include <ImfTiledOutputFile.h>
 #include <ImfRgbaFile.h>
 
 #include <ImfChannelList.h>
@@ -55,6 +56,9 @@
 #include <IexBaseExc.h>
 
 #include <list>
+#include <vector>
+#include <memory>
+#include <limits>
 
 #ifndef __MACH__
 #include <assert.h>
@@ -87,13 +91,37 @@ static int gNumCPUs = 1;
 // our prefs
 static A_long gChannelCaches = 3;
 static A_long gCacheTimeout = 30;
+static A_long gCacheMemory = 2048; // MB
 static A_long gAutoCacheChannels = 5;
 static A_Boolean gMemoryMap = FALSE;
+static A_long gMemoryMapCache = 4096; // MB
+static A_long gParallelParts = 4;
+static A_long gReadAheadFrames = 0;
+static A_Boolean gWriteBehind = FALSE;
+static A_long gBackgroundWriteFrames = 0;
+static A_Boolean gSidecarIndex = FALSE;
+static A_long gHeaderCacheFiles = 8;
 static A_Boolean gStorePersonal = FALSE;
 static A_Boolean gStoreMachine = FALSE;
 
 
 static OpenEXR_CachePool gCachePool;
+static OpenEXR_FileCache gFileCache;
+static SequenceReadAhead gReadAhead;
+static OpenEXR_HeaderIndex gHeaderIndex;
+static BackgroundJobs gBackgroundWriter;
+
+
+static size_t
+CacheMemoryBytes()
+{
+	if(gCacheMemory <= 0)
+		return 0; // no limit
+	
+	const double bytes = (double)gCacheMemory * 1024.0 * 1024.0;
+	
+	return (bytes < (double)numeric_limits<size_t>::max() ? (size_t)bytes : numeric_limits<size_t>::max());
+}
 
 
 A_Err
@@ -153,8 +181,18 @@ OpenEXR_Init(struct SPBasicSuite *pica_basicP)
 #define PREFS_SECTION	"OpenEXR"
 #define PREFS_CHANNEL_CACHES "Channel Caches Number"
 #define PREFS_CACHE_EXPIRATION "Channel Cache Expiration"
+#define PREFS_CACHE_MEMORY	"Channel Cache Memory MB"
 #define PREFS_AUTO_CACHE "Auto Cache Threshold"
 #define PREFS_MEMORY_MAP	"Memory Map"
+#define PREFS_MEMORY_MAP_CACHE	"Memory Map Cache MB"
+#define PREFS_PARALLEL_PARTS	"Parallel Parts"
+#define PREFS_READ_AHEAD	"Read Ahead Frames"
+#define PREFS_WRITE_BEHIND	"Write Behind"
+#define PREFS_BACKGROUND_WRITE	"Background Write Frames"
+#define PREFS_SIDECAR_INDEX	"Header Index Files In Footage Folders" // writes .exrindex next to the frames
+#define PREFS_HEADER_CACHE	"Header Cache Files"
+#define PREFS_HEADER_CACHE_HITS	"Header Cache Hits" // written at quit, not read
+#define PREFS_HEADER_CACHE_MISSES	"Header Cache Misses"
 #define PREFS_PERSONAL_INFO "Store Personal Info"
 #define PREFS_MACHINE_INFO	"Store Machine Info"
 	
@@ -165,27 +203,61 @@ OpenEXR_Init(struct SPBasicSuite *pica_basicP)
 	
 	A_long channel_caches = gChannelCaches; // defaults come from global initializations above
 	A_long cache_timeout = gCacheTimeout;
+	A_long cache_memory = gCacheMemory;
 	A_long auto_cache_channels = gAutoCacheChannels;
 	A_long memory_map = gMemoryMap;
+	A_long memory_map_cache = gMemoryMapCache;
+	A_long parallel_parts = gParallelParts;
+	A_long read_ahead_frames = gReadAheadFrames;
+	A_long write_behind = gWriteBehind;
+	A_long background_write_frames = gBackgroundWriteFrames;
+	A_long sidecar_index = gSidecarIndex;
+	A_long header_cache_files = gHeaderCacheFiles;
 	A_long store_personal = gStorePersonal;
 	A_long store_machine = gStoreMachine;
 	
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_CHANNEL_CACHES, channel_caches, &channel_caches);
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_CACHE_EXPIRATION, cache_timeout, &cache_timeout);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_CACHE_MEMORY, cache_memory, &cache_memory);
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_AUTO_CACHE, auto_cache_channels, &auto_cache_channels);
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_MEMORY_MAP, memory_map, &memory_map);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_MEMORY_MAP_CACHE, memory_map_cache, &memory_map_cache);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_PARALLEL_PARTS, parallel_parts, &parallel_parts);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_READ_AHEAD, read_ahead_frames, &read_ahead_frames);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_WRITE_BEHIND, write_behind, &write_behind);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_BACKGROUND_WRITE, background_write_frames, &background_write_frames);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_SIDECAR_INDEX, sidecar_index, &sidecar_index);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_HEADER_CACHE, header_cache_files, &header_cache_files);
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_PERSONAL_INFO, store_personal, &store_personal);
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_MACHINE_INFO, store_machine, &store_machine);
 	
 	gChannelCaches = channel_caches;
 	gCacheTimeout = cache_timeout;
+	gCacheMemory = cache_memory;
 	gAutoCacheChannels = auto_cache_channels;
 	gMemoryMap = (memory_map ? TRUE : FALSE);
+	gMemoryMapCache = memory_map_cache;
+	gParallelParts = parallel_parts;
+	gReadAheadFrames = read_ahead_frames;
+	gWriteBehind = (write_behind ? TRUE : FALSE);
+	gBackgroundWriteFrames = background_write_frames;
+	gSidecarIndex = (sidecar_index ? TRUE : FALSE);
+	gHeaderCacheFiles = header_cache_files;
 	gStorePersonal = (store_personal ? TRUE : FALSE);
 	gStoreMachine = (store_machine ? TRUE : FALSE);
 	
 	
-	gCachePool.configurePool(gChannelCaches, pica_basicP);
+	gCachePool.configurePool(gChannelCaches, CacheMemoryBytes(), pica_basicP);
+	
+	gFileCache.configureCache(gHeaderCacheFiles);
+	
+	ConfigureFileCache((Int64)max<A_long>(gMemoryMapCache, 0) * 1024 * 1024);
+	
+	gReadAhead.configure(gReadAheadFrames, gMemoryMap);
+	
+	gHeaderIndex.configure(gSidecarIndex);
+	
+	gBackgroundWriter.configure(gBackgroundWriteFrames);
 	
 	return err;
 }
@@ -200,13 +272,37 @@ OpenEXR_DeathHook(const SPBasicSuite *pica_basicP)
 		// AE will hang when the threads are killed by the thread pool
 		// destructor being called
 		// http://stackoverflow.com/questions/353038/endthreadex0-hangs
+		gReadAhead.configure(0, false);
+		
+		try{ gBackgroundWriter.finish(); }catch(...) {} // nobody to tell now
+		
+		gBackgroundWriter.configure(0);
+		
 		if( IlmThread::supportsThreads() )
 			setGlobalThreadCount(0);
 		
 		
-		gCachePool.configurePool(0);
+		gCachePool.configurePool(0, 0);
+		
+		gFileCache.configureCache(0);
+		
+		DeleteFileCache();
 		
-		DeleteFileCache(pica_basicP);
+		gHeaderIndex.configure(false);
+		
+		
+		try
+		{
+			// so you can see in the prefs file how well the header cache did this session
+			AEGP_SuiteHandler suites(pica_basicP);
+			
+			AEGP_PersistentBlobH blobH = NULL;
+			suites.PersistentDataSuite()->AEGP_GetApplicationBlob(&blobH);
+			
+			suites.PersistentDataSuite()->AEGP_SetLong(blobH, PREFS_SECTION, PREFS_HEADER_CACHE_HITS, gFileCache.hits());
+			suites.PersistentDataSuite()->AEGP_SetLong(blobH, PREFS_SECTION, PREFS_HEADER_CACHE_MISSES, gFileCache.misses());
+		}
+		catch(...) {}
 		
 		
 		if(gChannelMap)
@@ -228,8 +324,12 @@ OpenEXR_IdleHook(AEIO_BasicData *basic_dataP, AEIO_IdleFlags *idle_flags0)
 		if(deleted_something)
 			*idle_flags0 |= AEIO_IdleFlag_PURGED_MEM;
 		
-		DeleteFileCache(basic_dataP->pica_basicP, gCacheTimeout);
+		gFileCache.deleteStaleFiles(gCacheTimeout);
+		
+		DeleteFileCache(gCacheTimeout);
 	}
+	
+	gHeaderIndex.saveIndexes();
 
 	return A_Err_NONE;
 }
@@ -238,10 +338,13 @@ OpenEXR_IdleHook(AEIO_BasicData *basic_dataP, AEIO_IdleFlags *idle_flags0)
 A_Err
 OpenEXR_PurgeHook(const SPBasicSuite *pica_basicP)
 {
-	gCachePool.configurePool(0);
-	gCachePool.configurePool(gChannelCaches);
+	gCachePool.configurePool(0, 0);
+	gCachePool.configurePool(gChannelCaches, CacheMemoryBytes());
 	
-	DeleteFileCache(pica_basicP, 0);
+	gFileCache.configureCache(0);
+	gFileCache.configureCache(gHeaderCacheFiles);
+	
+	DeleteFileCache(0);
 	
 	return A_Err_NONE;
 }
@@ -529,9 +632,21 @@ OpenEXR_FileInfo(
 	ResizeOptionsHandle(basic_dataP, optionsH, &options, options_size);
 	
 	
-	// read the EXR
-	IStreamPlatform instream(file_pathZ);
-	HybridInputFile in(instream);
+	// read the EXR headers, we don't need the offset tables to know what's in there
+	vector<char> header_bytes;
+	
+	auto_ptr<IStream> instream;
+	IStreamPlatform *file_stream = NULL;
+	
+	if( gHeaderIndex.findHeaders(file_pathZ, header_bytes) )
+		instream.reset( new IStreamMemory(&header_bytes[0], header_bytes.size()) );
+	else
+		instream.reset( file_stream = new IStreamPlatform(file_pathZ) );
+	
+	HybridHeaders in(*instream);
+	
+	if(file_stream)
+		gHeaderIndex.addHeaders(*file_stream);
 	
 	const ChannelList &channels = in.channels();
 
@@ -1003,7 +1118,7 @@ static A_Err CopyBufferIterate( void	*refconPV,
 			*out_pix++ = *in_pix++;
 		}
 		
-		in_pix += (i_data->scale.v - 1) * i_data->num_channels;
+		in_pix += (i_data->scale.h - 1) * i_data->num_channels;
 	}
 
 #ifdef NDEBUG
@@ -1030,6 +1145,7 @@ typedef struct {
 	size_t out_rowbytes;
 	int width;
 	bool has_alpha;
+	PF_Point scale;
 } RgbaIterateData;
 
 template <typename InFormat, typename OutFormat>
@@ -1042,7 +1158,7 @@ static A_Err CopyRgbaBufferIterate( void	*refconPV,
 	
 	RgbaIterateData *i_data = (RgbaIterateData *)refconPV;
 	
-	InFormat *in_pix = (InFormat *)((char *)i_data->in + (i * i_data->in_rowbytes));
+	InFormat *in_pix = (InFormat *)((char *)i_data->in + (i * i_data->in_rowbytes * i_data->scale.v));
 	OutFormat *out_pix = (OutFormat *)((char *)i_data->out + (i * i_data->out_rowbytes));
 	
 	for(int x=0; x < i_data->width; x++)
@@ -1056,7 +1172,7 @@ static A_Err CopyRgbaBufferIterate( void	*refconPV,
 		else
 			out_pix->alpha = 1.f;
 		
-		in_pix++;
+		in_pix += i_data->scale.h;
 		out_pix++;
 	}
 
@@ -1069,10 +1185,111 @@ static A_Err CopyRgbaBufferIterate( void	*refconPV,
 }
 
 
+static void
+InsertARGBSlices(FrameBuffer &frameBuffer, char *exr_ARGB_origin, size_t rowbytes)
+{
+	frameBuffer.insert("A", Slice(Imf::FLOAT, exr_ARGB_origin + (sizeof(PF_FpShort) * 0), sizeof(PF_FpShort) * 4, rowbytes, 1, 1, 1.0) );
+	frameBuffer.insert("R", Slice(Imf::FLOAT, exr_ARGB_origin + (sizeof(PF_FpShort) * 1), sizeof(PF_FpShort) * 4, rowbytes, 1, 1, 0.0) );
+	frameBuffer.insert("G", Slice(Imf::FLOAT, exr_ARGB_origin + (sizeof(PF_FpShort) * 2), sizeof(PF_FpShort) * 4, rowbytes, 1, 1, 0.0) );
+	frameBuffer.insert("B", Slice(Imf::FLOAT, exr_ARGB_origin + (sizeof(PF_FpShort) * 3), sizeof(PF_FpShort) * 4, rowbytes, 1, 1, 0.0) );
+}
+
+
+// When AE is at partial resolution, pixel n of the world is sampled from
+// full-res pixel (origin + shift + n * scale).  This finds the range of world
+// pixels that sample from full-res pixels lo through hi.
+static void
+DecimatedRange(int lo, int hi, int origin, int scale, int shift, int world_size, int &first, int &last)
+{
+	const int lo_offset = lo - origin - shift;
+	const int hi_offset = hi - origin - shift;
+	
+	first = (lo_offset > 0 ? (lo_offset + scale - 1) / scale : 0);
+	last = (hi_offset >= 0 ? hi_offset / scale : -1);
+	
+	last = min(last, world_size - 1);
+}
+
+
+// Mipmap and ripmap levels are 2^l times smaller.  Pick the level that
+// matches AE's resolution or the next finer one, if every part has it.
+static void
+ChooseLevel(HybridInputFile &in, PF_Point scale, int &lx, int &ly)
+{
+	lx = ly = 0;
+	
+	while((2 << lx) <= scale.h)
+		lx++;
+	
+	while((2 << ly) <= scale.v)
+		ly++;
+	
+	while( (lx > 0 || ly > 0) && !in.isValidLevel(lx, ly) )
+	{
+		if(lx != ly)
+		{
+			// mipmaps only have levels that go down evenly
+			lx = ly = min(lx, ly);
+		}
+		else
+		{
+			lx--;
+			ly--;
+		}
+	}
+}
+
+
+// full-res pixel to the pixel in level l that covers it
+static inline int
+LevelPixel(int pos, int origin, int l, int level_max)
+{
+	return min(origin + ((pos - origin) >> l), level_max);
+}
+
+
+typedef struct {
+	const AEIO_InterruptFuncs *interP;
+	const char *in; // pixel (0,0), usually outside the buffer
+	size_t in_rowbytes;
+	const int *rows; // buffer row to sample for each output row
+	const int *cols; // buffer column to sample for each output column
+	char *out;
+	size_t out_rowbytes;
+	int width;
+} SampleIterateData;
+
+static A_Err SampleBufferIterate(	void	*refconPV,
+									A_long	thread_indexL,
+									A_long	i,
+									A_long	iterationsL)
+{
+	A_Err err = A_Err_NONE;
+	
+	SampleIterateData *i_data = (SampleIterateData *)refconPV;
+	
+	const PF_PixelFloat *in_row = (const PF_PixelFloat *)(i_data->in + ((ptrdiff_t)i_data->rows[i] * (ptrdiff_t)i_data->in_rowbytes));
+	PF_PixelFloat *out_pix = (PF_PixelFloat *)(i_data->out + (i * i_data->out_rowbytes));
+	
+	for(int x=0; x < i_data->width; x++)
+	{
+		*out_pix++ = in_row[ i_data->cols[x] ];
+	}
+
+#ifdef NDEBUG
+	if(thread_indexL == 0 && i_data->interP && i_data->interP->abort0)
+		err = i_data->interP->abort0(i_data->interP->refcon);
+#endif
+	
+	return err;
+}
+
+
 A_Err	
 OpenEXR_DrawSparseFrame(
 	AEIO_BasicData					*basic_dataP,
 	const AEIO_DrawSparseFramePB	*sparse_framePPB, 
+	PF_Point						scale,
 	PF_EffectWorld					*wP,
 	AEIO_DrawingFlags				*draw_flagsP,
 	const A_PathType				*file_pathZ,
@@ -1090,6 +1307,7 @@ OpenEXR_DrawSparseFrame(
 	PF_EffectWorld *temp_world = NULL;
 	
 	AEIO_Handle temp_RgbaH = NULL;
+	AEIO_Handle temp_bandH = NULL;
 	
 	
 	try{
@@ -1098,12 +1316,18 @@ OpenEXR_DrawSparseFrame(
 		setGlobalThreadCount(gNumCPUs);
 	
 		
-	IStreamPlatform instream(file_pathZ, basic_dataP->pica_basicP);
+	OpenEXR_CachedFile cached_file(gFileCache, file_pathZ, basic_dataP->pica_basicP);
+	
+	IStreamPlatform &instream = cached_file.stream();
 
 	if(gMemoryMap)
 		instream.memoryMap();
 
-	HybridInputFile in(instream);
+	HybridInputFile &in = cached_file.file();
+	
+	in.setParallelParts(&cached_file.streamSource(), gParallelParts);
+	
+	gReadAhead.frameRequested(instream.getPath(), instream.size());
 	
 	
 	assert(options != NULL); // but might be if someone opens a really old project
@@ -1117,6 +1341,44 @@ OpenEXR_DrawSparseFrame(
 	const Box2i &dispW = in.displayWindow();
 	
 	
+	const Box2i &sizeW = ((options != NULL && options->display_window == DW_DISPLAY_WINDOW) ? dispW : dataW);
+	
+	
+	// At partial resolution we sample from full-res scanlines directly into AE's smaller world.
+	// Like DrawAuxChannel, shift the pixel we sample to get closer to AE's own scaling.
+	const bool decimate = (scale.h > 1 || scale.v > 1);
+	
+	const int size_width = (sizeW.max.x - sizeW.min.x) + 1;
+	const int size_height = (sizeW.max.y - sizeW.min.y) + 1;
+	
+	PF_Point shift;
+	shift.h = (size_width % scale.h == 0) ? (scale.h - 1) : (size_width % scale.h - 1);
+	shift.v = (size_height % scale.v == 0) ? (scale.v - 1) : (size_height % scale.v - 1);
+	
+	
+	// the part of the dataWindow we actually have to read
+	Box2i readW = dataW;
+	
+	if(options != NULL && options->display_window == DW_DISPLAY_WINDOW)
+	{
+		readW.min.x = max(readW.min.x, dispW.min.x);
+		readW.min.y = max(readW.min.y, dispW.min.y);
+		readW.max.x = min(readW.max.x, dispW.max.x);
+		readW.max.y = min(readW.max.y, dispW.max.y);
+	}
+	
+	if(sparse_framePPB && sparse_framePPB->required_region0)
+	{
+		// AE only needs this rectangle of the world, right and bottom are exclusive
+		const A_LRect &region = *sparse_framePPB->required_region0;
+		
+		readW.min.x = max<int>(readW.min.x, sizeW.min.x + (region.left * scale.h));
+		readW.min.y = max<int>(readW.min.y, sizeW.min.y + (region.top * scale.v));
+		readW.max.x = min<int>(readW.max.x, sizeW.min.x + (region.right * scale.h) - 1);
+		readW.max.y = min<int>(readW.max.y, sizeW.min.y + (region.bottom * scale.v) - 1);
+	}
+	
+	
 	if(options != NULL && options->display_window == DW_DISPLAY_WINDOW)
 	{
 		if(	in.parts() > 1 ||
@@ -1142,16 +1404,27 @@ OpenEXR_DrawSparseFrame(
 				return err;
 			}
 		}
+		
+		// nothing AE asked for is inside the dataWindow
+		if( readW.isEmpty() )
+		{
+			return err;
+		}
 	
 		const int display_width = (dispW.max.x - dispW.min.x) + 1;
 		const int display_height = (dispW.max.y - dispW.min.y) + 1;
 		
-		assert(display_width == wP->width);
-		assert(display_height == wP->height);
+		assert((display_width + scale.h - 1) / scale.h == wP->width);
+		assert((display_height + scale.v - 1) / scale.v == wP->height);
 		
 		// if dataWindow is completely inside displayWindow, we can use the
 		// existing PF_World, otherwise have to create a new one
-		if( (dataW.min.x >= dispW.min.x) &&
+		if(decimate)
+		{
+			// sampling goes right into AE's world
+			active_world = wP;
+		}
+		else if( (dataW.min.x >= dispW.min.x) &&
 			(dataW.min.y >= dispW.min.y) &&
 			(dataW.max.x <= dispW.max.x) &&
 			(dataW.max.y <= dispW.max.y) )
@@ -1185,8 +1458,13 @@ OpenEXR_DrawSparseFrame(
 		const int data_width = (dataW.max.x - dataW.min.x) + 1;
 		const int data_height = (dataW.max.y - dataW.min.y) + 1;
 		
-		assert(data_width == wP->width);
-		assert(data_height == wP->height);
+		assert((data_width + scale.h - 1) / scale.h == wP->width);
+		assert((data_height + scale.v - 1) / scale.v == wP->height);
+		
+		if( readW.isEmpty() )
+		{
+			return err;
+		}
 		
 		active_world = wP;
 		pixel_origin = active_world->data;
@@ -1215,50 +1493,255 @@ OpenEXR_DrawSparseFrame(
 		
 		char *exr_ARGB_origin = (char *)pixel_origin - (sizeof(PF_Pixel32) * dataW.min.x) - (active_world->rowbytes * dataW.min.y);
 		
-		frameBuffer.insert("A", Slice(Imf::FLOAT, exr_ARGB_origin + (sizeof(PF_FpShort) * 0), sizeof(PF_FpShort) * 4, active_world->rowbytes, 1, 1, 1.0) );
-		frameBuffer.insert("R", Slice(Imf::FLOAT, exr_ARGB_origin + (sizeof(PF_FpShort) * 1), sizeof(PF_FpShort) * 4, active_world->rowbytes, 1, 1, 0.0) );
-		frameBuffer.insert("G", Slice(Imf::FLOAT, exr_ARGB_origin + (sizeof(PF_FpShort) * 2), sizeof(PF_FpShort) * 4, active_world->rowbytes, 1, 1, 0.0) );
-		frameBuffer.insert("B", Slice(Imf::FLOAT, exr_ARGB_origin + (sizeof(PF_FpShort) * 3), sizeof(PF_FpShort) * 4, active_world->rowbytes, 1, 1, 0.0) );
+		InsertARGBSlices(frameBuffer, exr_ARGB_origin, active_world->rowbytes);
 
 		
 		OpenEXR_ChannelCache *chan_cache = gCachePool.findCache(instream);
 		
 		if(chan_cache == NULL && options != NULL && options->cache_channels && gChannelCaches > 0)
 		{
-			chan_cache = gCachePool.addCache(in, instream, inter);			
+			chan_cache = gCachePool.addCache(in, instream);
 		}
 		
-		if(chan_cache)
+		if(decimate)
 		{
-			if( CONT() )
+			// Read a band of full-res scanlines at a time (from the file or the cache)
+			// and sample from it into AE's world.  No full-size buffer needed.
+			const int scanline_block_size = ScanlineBlockSize(in);
+			
+			// if every scanline is its own chunk, lines we don't sample never get read at all
+			const bool skip_lines = (chan_cache == NULL && SingleScanlineChunks(in));
+			
+			const int data_width = (dataW.max.x - dataW.min.x) + 1;
+			const int band_height = (skip_lines ? (scanline_block_size + scale.v - 1) / scale.v : scanline_block_size);
+			
+			const size_t band_rowbytes = sizeof(PF_PixelFloat) * data_width;
+			
+			suites.MemorySuite()->AEGP_NewMemHandle( S_mem_id, "temp_bandH",
+													band_rowbytes * band_height,
+													AEGP_MemFlag_CLEAR, &temp_bandH);
+			
+			if(temp_bandH == NULL)
+				throw NullExc("temp_bandH is NULL");
+			
+			
+			char *band = NULL;
+			
+			suites.MemorySuite()->AEGP_LockMemHandle(temp_bandH, (void**)&band);
+			
+			if(band == NULL)
+				throw NullExc("band is NULL");
+			
+			
+			// parts might not cover the whole band, so clear it like we do the world
+			PF_PixelFloat clear = { 0.f, 0.f, 0.f, 0.f };
+			
+			if(info->planes < 4)
+				clear.alpha = 1.f;
+			
+			
+			int first_col, last_col;
+			
+			DecimatedRange(readW.min.x, readW.max.x, sizeW.min.x, scale.h, shift.h, wP->width, first_col, last_col);
+			
+			const int first_x = sizeW.min.x + shift.h + (first_col * scale.h);
+			
+			
+			// cached channels are always full-res
+			int lx = 0, ly = 0;
+			
+			if(chan_cache == NULL)
+				ChooseLevel(in, scale, lx, ly);
+			
+			
+			if(lx > 0 || ly > 0)
+			{
+				// the file has a smaller version of the image, so read tiles from that level
+				const Box2i levelW = in.dataWindowForLevel(lx, ly);
+				
+				int first_row, last_row;
+				
+				DecimatedRange(readW.min.y, readW.max.y, sizeW.min.y, scale.v, shift.v, wP->height, first_row, last_row);
+				
+				if(first_row <= last_row && first_col <= last_col)
+				{
+					// level pixels our world samples from
+					vector<int> level_rows, level_cols;
+					
+					for(int row = first_row; row <= last_row; row++)
+						level_rows.push_back( LevelPixel(sizeW.min.y + shift.v + (row * scale.v), dataW.min.y, ly, levelW.max.y) );
+					
+					for(int col = first_col; col <= last_col; col++)
+						level_cols.push_back( LevelPixel(sizeW.min.x + shift.h + (col * scale.h), dataW.min.x, lx, levelW.max.x) );
+					
+					
+					const int begin_line = level_rows.front();
+					const int end_line = level_rows.back();
+					
+					size_t r = 0;
+					
+					int y = begin_line;
+					
+					while(y <= end_line && !err2 && PROG(y - begin_line, end_line - begin_line) )
+					{
+						const int block_end = levelW.min.y + ((((y - levelW.min.y) / band_height) + 1) * band_height) - 1;
+						
+						const int high_scanline = min(block_end, end_line);
+						
+						const size_t r_begin = r;
+						
+						while(r < level_rows.size() && level_rows[r] <= high_scanline)
+							r++;
+						
+						if(r > r_begin)
+						{
+							if(in.parts() > 1)
+							{
+								PF_PixelFloat *pix = (PF_PixelFloat *)band;
+								
+								for(int i=0; i < data_width * band_height; i++)
+									*pix++ = clear;
+							}
+							
+							char *band_origin = band - (sizeof(PF_Pixel32) * levelW.min.x) - (band_rowbytes * y);
+							
+							FrameBuffer bandBuffer;
+							
+							InsertARGBSlices(bandBuffer, band_origin, band_rowbytes);
+							
+							in.setFrameBuffer(bandBuffer);
+							
+							in.readRegion( Box2i(V2i(level_cols.front(), y), V2i(level_cols.back(), high_scanline)), lx, ly );
+							
+							
+							char *world_origin = (char *)wP->data + (wP->rowbytes * (first_row + r_begin)) + (sizeof(PF_Pixel32) * first_col);
+							
+							SampleIterateData s_data = { inter, band_origin, band_rowbytes, &level_rows[r_begin], &level_cols[0], world_origin, wP->rowbytes, (last_col - first_col) + 1 };
+							
+							err2 = suites.AEGPIterateSuite()->AEGP_IterateGeneric(r - r_begin, (void *)&s_data, SampleBufferIterate);
+						}
+						
+						y = high_scanline + 1;
+					}
+				}
+			}
+			else
 			{
-				chan_cache->fillFrameBuffer(frameBuffer, dataW);
+				int y = readW.min.y;
+				
+				while(y <= readW.max.y && !err2 && PROG(y - readW.min.y, readW.max.y - readW.min.y) )
+				{
+					const int block_end = dataW.min.y + ((((y - dataW.min.y) / scanline_block_size) + 1) * scanline_block_size) - 1;
+					
+					const int high_scanline = min(block_end, readW.max.y);
+					
+					int first_row, last_row;
+					
+					DecimatedRange(y, high_scanline, sizeW.min.y, scale.v, shift.v, wP->height, first_row, last_row);
+					
+					if(first_row <= last_row && first_col <= last_col)
+					{
+						if(in.parts() > 1)
+						{
+							PF_PixelFloat *pix = (PF_PixelFloat *)band;
+							
+							for(int i=0; i < data_width * band_height; i++)
+								*pix++ = clear;
+						}
+						
+						
+						const int first_line = sizeW.min.y + shift.v + (first_row * scale.v);
+						
+						PF_Point band_scale = scale;
+						
+						const char *band_origin = NULL;
+						
+						if(skip_lines)
+						{
+							for(int row = first_row; row <= last_row; row++)
+							{
+								const int line = sizeW.min.y + shift.v + (row * scale.v);
+								
+								char *band_row = band + (band_rowbytes * (row - first_row));
+								
+								FrameBuffer lineBuffer;
+								
+								InsertARGBSlices(lineBuffer, band_row - (sizeof(PF_Pixel32) * dataW.min.x) - (band_rowbytes * line), band_rowbytes);
+								
+								in.setFrameBuffer(lineBuffer);
+								
+								in.readRegion( Box2i(V2i(readW.min.x, line), V2i(readW.max.x, line)) );
+							}
+							
+							band_scale.v = 1; // band only has the lines we sample
+							
+							band_origin = band;
+						}
+						else
+						{
+							FrameBuffer bandBuffer;
+							
+							InsertARGBSlices(bandBuffer, band - (sizeof(PF_Pixel32) * dataW.min.x) - (band_rowbytes * y), band_rowbytes);
+							
+							const Box2i bandW(V2i(readW.min.x, y), V2i(readW.max.x, high_scanline));
+							
+							if(chan_cache == NULL || !chan_cache->fillFrameBuffer(in, bandBuffer, dataW, bandW, inter))
+							{
+								in.setFrameBuffer(bandBuffer);
+								
+								in.readRegion(bandW);
+							}
+							
+							band_origin = band + (band_rowbytes * (first_line - y));
+						}
+						
+						
+						band_origin += sizeof(PF_Pixel32) * (first_x - dataW.min.x);
+						
+						char *world_origin = (char *)wP->data + (wP->rowbytes * first_row) + (sizeof(PF_Pixel32) * first_col);
+						
+						PF_Point no_shift = {0, 0};
+						
+						IterateData i_data = { inter, (void *)band_origin, band_rowbytes, (void *)world_origin, wP->rowbytes, 4, (last_col - first_col) + 1, band_scale, no_shift };
+						
+						err2 = suites.AEGPIterateSuite()->AEGP_IterateGeneric((last_row - first_row) + 1, (void *)&i_data, CopyBufferIterate<float, float>);
+					}
+					
+					y = high_scanline + 1;
+				}
 			}
 		}
 		else
 		{
-			in.setFrameBuffer(frameBuffer);
-
-			int begin_line = dataW.min.y;
-			int end_line = dataW.max.y;
-			
-			if(options != NULL && options->display_window == DW_DISPLAY_WINDOW)
-			{
-				begin_line = max(dataW.min.y, dispW.min.y);
-				end_line = min(dataW.max.y, dispW.max.y);
-			}
+			bool filled = false;
 			
-			const int scanline_block_size = ScanlineBlockSize(in);
-			
-			int y = begin_line;
+			if(chan_cache && CONT())
+				filled = chan_cache->fillFrameBuffer(in, frameBuffer, dataW, readW, inter);
 			
-			while(y <= end_line && PROG(y - begin_line, end_line - begin_line) )
+			// no cache or it couldn't hold the channels
+			if(!filled && !err2)
 			{
-				int high_scanline = min(y + scanline_block_size - 1, end_line);
+				in.setFrameBuffer(frameBuffer);
+
+				const int begin_line = readW.min.y;
+				const int end_line = readW.max.y;
 				
-				in.readPixels(y, high_scanline);
+				const int scanline_block_size = ScanlineBlockSize(in);
 				
-				y = high_scanline + 1;
+				int y = begin_line;
+				
+				while(y <= end_line && PROG(y - begin_line, end_line - begin_line) )
+				{
+					// end blocks on boundaries relative to the top of the dataWindow,
+					// so a chunk doesn't get decoded twice
+					const int block_end = dataW.min.y + ((((y - dataW.min.y) / scanline_block_size) + 1) * scanline_block_size) - 1;
+					
+					int high_scanline = min(block_end, end_line);
+					
+					in.readRegion( Box2i(V2i(readW.min.x, y), V2i(readW.max.x, high_scanline)) );
+					
+					y = high_scanline + 1;
+				}
 			}
 		}
 	}
@@ -1273,62 +1756,137 @@ OpenEXR_DrawSparseFrame(
 
 		
 		const int data_width = (dataW.max.x - dataW.min.x) + 1;
-		const int data_height = (dataW.max.y - dataW.min.y) + 1;
-		
-		
-		const size_t data_rowbytes = sizeof(RgbaPixel) * data_width;
-		
-		suites.MemorySuite()->AEGP_NewMemHandle( S_mem_id, "temp_RgbaH",
-												data_rowbytes * data_height,
-												AEGP_MemFlag_CLEAR, &temp_RgbaH);
-												
-		if(temp_RgbaH == NULL)
-			throw NullExc("temp_RgbaH is NULL");
-		
-		
-		char *temp_Rgba = NULL;
-		
-		suites.MemorySuite()->AEGP_LockMemHandle(temp_RgbaH, (void**)&temp_Rgba);
-		
-		if(temp_Rgba == NULL)
-			throw NullExc("temp_Rgba is NULL");
 		
+		const int read_width = (readW.max.x - readW.min.x) + 1;
+		const int read_height = (readW.max.y - readW.min.y) + 1;
 		
-		Rgba *Rgba_origin = (Rgba *)(temp_Rgba - (sizeof(Rgba) * dataW.min.x) - (data_rowbytes * dataW.min.y));
 		
-		inputFile.setFrameBuffer(Rgba_origin, 1, data_width);
-		
-		
-		int begin_line = dataW.min.y;
-		int end_line = dataW.max.y;
-		
-		if(options != NULL && options->display_window == DW_DISPLAY_WINDOW)
-		{
-			begin_line = max(dataW.min.y, dispW.min.y);
-			end_line = min(dataW.max.y, dispW.max.y);
-		}
-		
-		
-		int y = begin_line;
-		
-		while(y <= end_line && PROG(y - begin_line, end_line - begin_line))
+		if(decimate)
 		{
-			int high_scanline = min(y + scanline_block_size - 1, end_line);
+			// read bands of full-res scanlines and sample them into AE's world
+			const size_t band_rowbytes = sizeof(RgbaPixel) * data_width;
 			
-			inputFile.readPixels(y, high_scanline);
+			suites.MemorySuite()->AEGP_NewMemHandle( S_mem_id, "temp_RgbaH",
+													band_rowbytes * scanline_block_size,
+													AEGP_MemFlag_CLEAR, &temp_RgbaH);
+													
+			if(temp_RgbaH == NULL)
+				throw NullExc("temp_RgbaH is NULL");
 			
-			y = high_scanline + 1;
-		}
-		
-		
-		if(!err && !err2)
-		{
-			const bool have_alpha = (inputFile.channels() & WRITE_A);
 			
-			RgbaIterateData i_data = { inter, temp_Rgba, data_rowbytes, pixel_origin, active_world->rowbytes, data_width, have_alpha };
+			char *band = NULL;
 			
-			err2 = suites.AEGPIterateSuite()->AEGP_IterateGeneric(data_height, (void *)&i_data, CopyRgbaBufferIterate<RgbaPixel, PF_PixelFloat>);
-		}
+			suites.MemorySuite()->AEGP_LockMemHandle(temp_RgbaH, (void**)&band);
+			
+			if(band == NULL)
+				throw NullExc("band is NULL");
+			
+			
+			const bool have_alpha = (inputFile.channels() & WRITE_A);
+			
+			int first_col, last_col;
+			
+			DecimatedRange(readW.min.x, readW.max.x, sizeW.min.x, scale.h, shift.h, wP->width, first_col, last_col);
+			
+			const int first_x = sizeW.min.x + shift.h + (first_col * scale.h);
+			
+			
+			int y = readW.min.y;
+			
+			while(y <= readW.max.y && !err2 && PROG(y - readW.min.y, readW.max.y - readW.min.y) )
+			{
+				const int block_end = dataW.min.y + ((((y - dataW.min.y) / scanline_block_size) + 1) * scanline_block_size) - 1;
+				
+				const int high_scanline = min(block_end, readW.max.y);
+				
+				int first_row, last_row;
+				
+				DecimatedRange(y, high_scanline, sizeW.min.y, scale.v, shift.v, wP->height, first_row, last_row);
+				
+				if(first_row <= last_row && first_col <= last_col)
+				{
+					Rgba *Rgba_origin = (Rgba *)(band - (sizeof(Rgba) * dataW.min.x) - (band_rowbytes * y));
+					
+					inputFile.setFrameBuffer(Rgba_origin, 1, data_width);
+					
+					inputFile.readPixels(y, high_scanline);
+					
+					
+					const int first_line = sizeW.min.y + shift.v + (first_row * scale.v);
+					
+					const char *band_origin = band + (band_rowbytes * (first_line - y)) + (sizeof(RgbaPixel) * (first_x - dataW.min.x));
+					
+					char *world_origin = (char *)wP->data + (wP->rowbytes * first_row) + (sizeof(PF_PixelFloat) * first_col);
+					
+					RgbaIterateData i_data = { inter, band_origin, band_rowbytes, world_origin, wP->rowbytes, (last_col - first_col) + 1, have_alpha, scale };
+					
+					err2 = suites.AEGPIterateSuite()->AEGP_IterateGeneric((last_row - first_row) + 1, (void *)&i_data, CopyRgbaBufferIterate<RgbaPixel, PF_PixelFloat>);
+				}
+				
+				y = high_scanline + 1;
+			}
+		}
+		else
+		{
+			// RgbaInputFile reads whole lines, but only the ones we need
+			const size_t data_rowbytes = sizeof(RgbaPixel) * data_width;
+			
+			suites.MemorySuite()->AEGP_NewMemHandle( S_mem_id, "temp_RgbaH",
+													data_rowbytes * read_height,
+													AEGP_MemFlag_CLEAR, &temp_RgbaH);
+													
+			if(temp_RgbaH == NULL)
+				throw NullExc("temp_RgbaH is NULL");
+			
+			
+			char *temp_Rgba = NULL;
+			
+			suites.MemorySuite()->AEGP_LockMemHandle(temp_RgbaH, (void**)&temp_Rgba);
+			
+			if(temp_Rgba == NULL)
+				throw NullExc("temp_Rgba is NULL");
+			
+			
+			Rgba *Rgba_origin = (Rgba *)(temp_Rgba - (sizeof(Rgba) * dataW.min.x) - (data_rowbytes * readW.min.y));
+			
+			inputFile.setFrameBuffer(Rgba_origin, 1, data_width);
+			
+			
+			const int begin_line = readW.min.y;
+			const int end_line = readW.max.y;
+			
+			
+			int y = begin_line;
+			
+			while(y <= end_line && PROG(y - begin_line, end_line - begin_line))
+			{
+				const int block_end = dataW.min.y + ((((y - dataW.min.y) / scanline_block_size) + 1) * scanline_block_size) - 1;
+				
+				int high_scanline = min(block_end, end_line);
+				
+				inputFile.readPixels(y, high_scanline);
+				
+				y = high_scanline + 1;
+			}
+			
+			
+			if(!err && !err2)
+			{
+				const bool have_alpha = (inputFile.channels() & WRITE_A);
+				
+				const char *read_origin = temp_Rgba + (sizeof(RgbaPixel) * (readW.min.x - dataW.min.x));
+				
+				PF_PixelPtr read_pixel_origin = (PF_PixelPtr)((char *)pixel_origin +
+																(active_world->rowbytes * (readW.min.y - dataW.min.y)) +
+																(sizeof(PF_PixelFloat) * (readW.min.x - dataW.min.x)) );
+				
+				PF_Point no_scale = {1, 1};
+				
+				RgbaIterateData i_data = { inter, read_origin, data_rowbytes, read_pixel_origin, active_world->rowbytes, read_width, have_alpha, no_scale };
+				
+				err2 = suites.AEGPIterateSuite()->AEGP_IterateGeneric(read_height, (void *)&i_data, CopyRgbaBufferIterate<RgbaPixel, PF_PixelFloat>);
+			}
+		}
 	}
 	
 	
@@ -1339,30 +1897,14 @@ OpenEXR_DrawSparseFrame(
 		PF_EffectWorld *data_world = temp_world;
 		
 		
+		// readW is already inside both windows
 		PF_Point disp_origin, data_origin;
 		
-		if(dispW.min.x < dataW.min.x)
-		{
-			disp_origin.h = dataW.min.x - dispW.min.x;
-			data_origin.h = 0;
-		}
-		else
-		{
-			disp_origin.h = 0;
-			data_origin.h = dispW.min.x - dataW.min.x;
-		}
-		
+		disp_origin.h = readW.min.x - dispW.min.x;
+		disp_origin.v = readW.min.y - dispW.min.y;
 		
-		if(dispW.min.y < dataW.min.y)
-		{
-			disp_origin.v = dataW.min.y - dispW.min.y;
-			data_origin.v = 0;
-		}
-		else
-		{
-			disp_origin.v = 0;
-			data_origin.v = dispW.min.y - dataW.min.y;
-		}
+		data_origin.h = readW.min.x - dataW.min.x;
+		data_origin.v = readW.min.y - dataW.min.y;
 		
 		PF_PixelPtr display_pixel_origin = (PF_PixelPtr)((char *)display_world->data +
 														(disp_origin.v * display_world->rowbytes) +
@@ -1373,8 +1915,8 @@ OpenEXR_DrawSparseFrame(
 														(data_origin.h * sizeof(PF_PixelFloat)) );
 		
 		
-		int copy_width = min(dispW.max.x, dataW.max.x) - max(dispW.min.x, dataW.min.x) + 1;
-		int copy_height = min(dispW.max.y, dataW.max.y) - max(dispW.min.y, dataW.min.y) + 1;
+		int copy_width = (readW.max.x - readW.min.x) + 1;
+		int copy_height = (readW.max.y - readW.min.y) + 1;
 		
 
 		PF_Point scale = {1, 1};
@@ -1399,6 +1941,9 @@ OpenEXR_DrawSparseFrame(
 	
 	if(temp_RgbaH)
 		suites.MemorySuite()->AEGP_FreeMemHandle(temp_RgbaH);
+	
+	if(temp_bandH)
+		suites.MemorySuite()->AEGP_FreeMemHandle(temp_bandH);
 		
 	
 	if(err2) { err = err2; }
@@ -1482,7 +2027,7 @@ OpenEXR_ReadOptionsDialog(
 
 				gChannelCaches = num_caches;
 				
-				gCachePool.configurePool(gChannelCaches, basic_dataP->pica_basicP);
+				gCachePool.configurePool(gChannelCaches, CacheMemoryBytes(), basic_dataP->pica_basicP);
 			}
 			
 			if(user_interactedPB0) // old AE was leaving this NULL
@@ -1702,12 +2247,16 @@ OpenEXR_DrawAuxChannel(
 	
 	
 	// read the EXR
-	IStreamPlatform instream(file_pathZ, basic_dataP->pica_basicP);
+	OpenEXR_CachedFile cached_file(gFileCache, file_pathZ, basic_dataP->pica_basicP);
+	
+	IStreamPlatform &instream = cached_file.stream();
 	
 	if(gMemoryMap)
 		instream.memoryMap();
 	
-	HybridInputFile in(instream);
+	HybridInputFile &in = cached_file.file();
+	
+	in.setParallelParts(&cached_file.streamSource(), gParallelParts);
 	
 	const ChannelList &channels = in.channels();
 	
@@ -1908,7 +2457,7 @@ OpenEXR_DrawAuxChannel(
 		{
 			try
 			{
-				chan_cache = gCachePool.addCache(in, instream, interP);
+				chan_cache = gCachePool.addCache(in, instream);
 			}
 			catch(CancelExc &e) { err2 = e.err(); }
 		}
@@ -1916,14 +2465,18 @@ OpenEXR_DrawAuxChannel(
 		
 		if(!err && !err2)
 		{
-			if(chan_cache)
+			bool filled = false;
+			
+			if(chan_cache && CONT2())
 			{
-				if( CONT2() )
+				try
 				{
-					chan_cache->fillFrameBuffer(frameBuffer, dataW);
+					filled = chan_cache->fillFrameBuffer(in, frameBuffer, dataW, interP);
 				}
+				catch(CancelExc &e) { err2 = e.err(); }
 			}
-			else
+			
+			if(!filled && !err2)
 			{
 				in.setFrameBuffer(frameBuffer);
 
@@ -2105,21 +2658,479 @@ OpenEXR_InitOutOptions(
 	options->compression_type = Imf::PIZ_COMPRESSION;
 	options->float_not_half = FALSE;
 	options->luminance_chroma = FALSE;
+	options->tiles = TILES_NONE;
+	options->tile_size_log2 = TILE_SIZE_DEFAULT_LOG2;
 
 	return err;
 }
 
 
+// AE's float ARGB pixels, or a smaller level made from them
 typedef struct {
-	void *in;
+	const char *data;
+	size_t rowbytes;
+	int width;
+	int height;
+} FloatARGB;
+
+
+// Converts some float ARGB rows to half, into a band buffer that starts at band_first_row.
+// Each band row is four planes: R, G, B, A.  Runs while OpenEXR compresses the band before.
+class FloatToHalfTask : public IlmThread::Task
+{
+  public:
+	FloatToHalfTask(IlmThread::TaskGroup *group, const FloatARGB &in, half *band, size_t band_rowbytes,
+						int band_first_row, int first_row, int last_row);
+	virtual ~FloatToHalfTask() {}
+	
+	virtual void execute();
+	
+  private:
+	const FloatARGB _in;
+	half *_band;
+	size_t _band_rowbytes;
+	int _band_first_row;
+	int _first_row;
+	int _last_row;
+};
+
+
+FloatToHalfTask::FloatToHalfTask(IlmThread::TaskGroup *group, const FloatARGB &in, half *band, size_t band_rowbytes,
+									int band_first_row, int first_row, int last_row) :
+	IlmThread::Task(group),
+	_in(in),
+	_band(band),
+	_band_rowbytes(band_rowbytes),
+	_band_first_row(band_first_row),
+	_first_row(first_row),
+	_last_row(last_row)
+{
+
+}
+
+
+void
+FloatToHalfTask::execute()
+{
+	for(int y = _first_row; y <= _last_row; y++)
+	{
+		const float *in = (const float *)(_in.data + (y * _in.rowbytes));
+		half *row = (half *)((char *)_band + ((y - _band_first_row) * _band_rowbytes));
+		
+		const int width = _in.width;
+		
+		// AE's ARGB order is A, R, G, B
+		half * const out[4] = { row + (3 * width), row, row + width, row + (2 * width) };
+		
+		FloatToHalfDeinterleave(in, out, width);
+	}
+}
+
+
+// split the band's conversion up for the thread pool, the TaskGroup waits for it
+static void
+AddFloatToHalfTasks(IlmThread::TaskGroup *group, const FloatARGB &in, half *band, size_t band_rowbytes,
+						int band_first_row, int band_rows)
+{
+	const int num_tasks = min(band_rows, max(globalThreadCount(), 1));
+	
+	const int task_rows = (band_rows + num_tasks - 1) / num_tasks;
+	
+	const int band_last_row = band_first_row + band_rows - 1;
+	
+	for(int y = band_first_row; y <= band_last_row; y += task_rows)
+	{
+		IlmThread::ThreadPool::addGlobalTask(new FloatToHalfTask(group, in, band, band_rowbytes, band_first_row,
+																	y, min(y + task_rows - 1, band_last_row)) );
+	}
+}
+
+
+static void
+InsertOutputSlices(FrameBuffer &frameBuffer, Imf::PixelType pix_type, char *ARGB_origin, size_t rowbytes, bool alpha)
+{
+	const size_t pix_size = (pix_type == Imf::FLOAT ? sizeof(float) : sizeof(half));
+	
+	frameBuffer.insert("R", Slice(pix_type, ARGB_origin + (pix_size * 1), pix_size * 4, rowbytes) );
+	frameBuffer.insert("G", Slice(pix_type, ARGB_origin + (pix_size * 2), pix_size * 4, rowbytes) );
+	frameBuffer.insert("B", Slice(pix_type, ARGB_origin + (pix_size * 3), pix_size * 4, rowbytes) );
+	
+	if(alpha)
+		frameBuffer.insert("A", Slice(pix_type, ARGB_origin + (pix_size * 0), pix_size * 4, rowbytes) );
+}
+
+
+// Like ScanlineBlockSize, enough lines at a time that every thread gets a chunk to compress.
+static int
+OutputBlockSize(const Header &header)
+{
+	const int scanline_block_size = (header.compression() == DWAB_COMPRESSION ? 256 : 32);
+	
+	return scanline_block_size * max(globalThreadCount(), 1);
+}
+
+
+class ScanlineBandWriter
+{
+  public:
+	ScanlineBandWriter(OutputFile &file) : _file(file) {}
+	
+	void setFrameBuffer(const FrameBuffer &frameBuffer) { _file.setFrameBuffer(frameBuffer); }
+	void writeBand(int y, int rows) { _file.writePixels(rows); }
+	
+  private:
+	OutputFile &_file;
+};
+
+
+// bands are one row of tiles
+class TiledBandWriter
+{
+  public:
+	TiledBandWriter(TiledOutputFile &file, int lx, int ly) : _file(file), _lx(lx), _ly(ly) {}
+	
+	void setFrameBuffer(const FrameBuffer &frameBuffer) { _file.setFrameBuffer(frameBuffer); }
+	
+	void writeBand(int y, int rows)
+	{
+		const int ty = y / _file.tileYSize();
+		
+		_file.writeTiles(0, _file.numXTiles(_lx) - 1, ty, ty, _lx, _ly);
+	}
+	
+  private:
+	TiledOutputFile &_file;
+	int _lx;
+	int _ly;
+};
+
+
+// Converted to half a band at a time, instead of making a whole half copy of the frame.
+// While OpenEXR compresses one band, the thread pool converts the next one.
+// The band rows are planar, so the slices are contiguous.
+template <typename BandWriter>
+static void
+WriteHalfBands(BandWriter &writer, const FloatARGB &in, int band_rows, bool alpha)
+{
+	band_rows = min(band_rows, in.height);
+	
+	const size_t band_rowbytes = sizeof(half) * 4 * in.width;
+	
+	const size_t plane_size = sizeof(half) * in.width;
+	
+	Array2D<half> half_bands(2 * band_rows, 4 * in.width);
+	
+	
+	if(true) // making a scope for TaskGroup
+	{
+		IlmThread::TaskGroup group;
+		
+		AddFloatToHalfTasks(&group, in, &half_bands[0][0], band_rowbytes, 0, band_rows);
+	}
+	
+	for(int y=0, band=0; y < in.height; y += band_rows, band++)
+	{
+		const int rows = min(band_rows, in.height - y);
+		
+		half *this_band = &half_bands[(band % 2) * band_rows][0];
+		
+		char *origin = (char *)this_band - (y * band_rowbytes);
+		
+		FrameBuffer frameBuffer;
+		
+		frameBuffer.insert("R", Slice(Imf::HALF, origin + (plane_size * 0), sizeof(half), band_rowbytes) );
+		frameBuffer.insert("G", Slice(Imf::HALF, origin + (plane_size * 1), sizeof(half), band_rowbytes) );
+		frameBuffer.insert("B", Slice(Imf::HALF, origin + (plane_size * 2), sizeof(half), band_rowbytes) );
+		
+		if(alpha)
+			frameBuffer.insert("A", Slice(Imf::HALF, origin + (plane_size * 3), sizeof(half), band_rowbytes) );
+		
+		writer.setFrameBuffer(frameBuffer);
+		
+		
+		if(true) // making a scope for TaskGroup
+		{
+			IlmThread::TaskGroup group;
+			
+			const int next_y = y + band_rows;
+			
+			if(next_y < in.height)
+			{
+				half *next_band = &half_bands[((band + 1) % 2) * band_rows][0];
+				
+				AddFloatToHalfTasks(&group, in, next_band, band_rowbytes, next_y, min(band_rows, in.height - next_y));
+			}
+			
+			writer.writeBand(y, rows);
+		}
+	}
+}
+
+
+// Box filters rows of a level down to the next one.  With ROUND_DOWN levels,
+// each pixel covers 1 to 3 pixels of the bigger level in each direction.
+class DownsampleTask : public IlmThread::Task
+{
+  public:
+	DownsampleTask(IlmThread::TaskGroup *group, const FloatARGB &in, const FloatARGB &out, int first_row, int last_row);
+	virtual ~DownsampleTask() {}
+	
+	virtual void execute();
+	
+  private:
+	const FloatARGB _in;
+	const FloatARGB _out;
+	int _first_row;
+	int _last_row;
+};
+
+
+DownsampleTask::DownsampleTask(IlmThread::TaskGroup *group, const FloatARGB &in, const FloatARGB &out, int first_row, int last_row) :
+	IlmThread::Task(group),
+	_in(in),
+	_out(out),
+	_first_row(first_row),
+	_last_row(last_row)
+{
+
+}
+
+
+void
+DownsampleTask::execute()
+{
+	for(int y = _first_row; y <= _last_row; y++)
+	{
+		const int in_y0 = (y * _in.height) / _out.height;
+		const int in_y1 = ((y + 1) * _in.height) / _out.height;
+		
+		float *out = (float *)(_out.data + (y * _out.rowbytes));
+		
+		for(int x=0; x < _out.width; x++)
+		{
+			const int in_x0 = (x * _in.width) / _out.width;
+			const int in_x1 = ((x + 1) * _in.width) / _out.width;
+			
+			float sum[4] = { 0.f, 0.f, 0.f, 0.f };
+			
+			for(int in_y = in_y0; in_y < in_y1; in_y++)
+			{
+				const float *in = (const float *)(_in.data + (in_y * _in.rowbytes)) + (4 * in_x0);
+				
+				for(int in_x = in_x0; in_x < in_x1; in_x++)
+				{
+					sum[0] += *in++;
+					sum[1] += *in++;
+					sum[2] += *in++;
+					sum[3] += *in++;
+				}
+			}
+			
+			const float scale = 1.f / (float)((in_x1 - in_x0) * (in_y1 - in_y0));
+			
+			*out++ = sum[0] * scale;
+			*out++ = sum[1] * scale;
+			*out++ = sum[2] * scale;
+			*out++ = sum[3] * scale;
+		}
+	}
+}
+
+
+static void
+MakeLevel(const FloatARGB &in, Array2D<float> &buffer, FloatARGB &out, int width, int height)
+{
+	buffer.resizeErase(height, 4 * width);
+	
+	out.data = (const char *)&buffer[0][0];
+	out.rowbytes = sizeof(float) * 4 * width;
+	out.width = width;
+	out.height = height;
+	
+	IlmThread::TaskGroup group;
+	
+	const int num_tasks = min(height, max(globalThreadCount(), 1));
+	
+	const int task_rows = (height + num_tasks - 1) / num_tasks;
+	
+	for(int y=0; y < height; y += task_rows)
+	{
+		IlmThread::ThreadPool::addGlobalTask(new DownsampleTask(&group, in, out, y, min(y + task_rows, height) - 1));
+	}
+}
+
+
+static void
+WriteTiledLevel(TiledOutputFile &file, const FloatARGB &level, int lx, int ly, Imf::PixelType pix_type, bool alpha)
+{
+	if(pix_type == Imf::FLOAT)
+	{
+		FrameBuffer frameBuffer;
+		
+		InsertOutputSlices(frameBuffer, Imf::FLOAT, (char *)level.data, level.rowbytes, alpha);
+		
+		file.setFrameBuffer(frameBuffer);
+		file.writeTiles(0, file.numXTiles(lx) - 1, 0, file.numYTiles(ly) - 1, lx, ly);
+	}
+	else
+	{
+		TiledBandWriter writer(file, lx, ly);
+		
+		WriteHalfBands(writer, level, file.tileYSize(), alpha);
+	}
+}
+
+
+// Writes the full resolution tiles from AE's buffer, then makes each smaller level
+// from the one before it (or for ripmaps, from the first level in the row above).
+// We only keep the levels that will be needed to make the next ones.
+static void
+WriteTiledLevels(TiledOutputFile &file, const FloatARGB &frame, Imf::PixelType pix_type, bool alpha)
+{
+	const bool ripmap = (file.levelMode() == RIPMAP_LEVELS);
+	
+	const int x_levels = file.numXLevels();
+	const int y_levels = (ripmap ? file.numYLevels() : 1);
+	
+	FloatARGB row_start = frame, previous = frame;
+	
+	auto_ptr< Array2D<float> > row_start_buf, previous_buf;
+	
+	for(int ly=0; ly < y_levels; ly++)
+	{
+		for(int lx=0; lx < x_levels; lx++)
+		{
+			const int level_y = (ripmap ? ly : lx);
+			
+			FloatARGB level = frame;
+			
+			auto_ptr< Array2D<float> > level_buf;
+			
+			if(lx > 0 || ly > 0)
+			{
+				level_buf.reset(new Array2D<float>);
+				
+				MakeLevel((lx == 0 ? row_start : previous), *level_buf, level, file.levelWidth(lx), file.levelHeight(level_y));
+			}
+			
+			WriteTiledLevel(file, level, lx, level_y, pix_type, alpha);
+			
+			if(lx == 0)
+			{
+				row_start = level;
+				row_start_buf = level_buf;
+				
+				previous_buf.reset();
+			}
+			else
+				previous_buf = level_buf;
+			
+			previous = level;
+		}
+	}
+}
+
+
+static void
+WriteFloatARGBFile(const A_PathType *file_pathZ, const Header &header, const FloatARGB &frame, Imf::PixelType pix_type, bool alpha)
+{
+	OStreamPlatform outstream(file_pathZ, gWriteBehind);
+	
+	if( header.hasTileDescription() ) // the files have to be closed before we finish the stream
+	{
+		TiledOutputFile file(outstream, header);
+		
+		WriteTiledLevels(file, frame, pix_type, alpha);
+	}
+	else
+	{
+		OutputFile file(outstream, header);
+		
+		if(pix_type == Imf::FLOAT)
+		{
+			// AE's buffer can go right in
+			FrameBuffer frameBuffer;
+			
+			InsertOutputSlices(frameBuffer, Imf::FLOAT, (char *)frame.data, frame.rowbytes, alpha);
+			
+			file.setFrameBuffer(frameBuffer);
+			file.writePixels(frame.height);
+		}
+		else
+		{
+			ScanlineBandWriter writer(file);
+			
+			WriteHalfBands(writer, frame, OutputBlockSize(header), alpha);
+		}
+	}
+	
+	outstream.finish();
+}
+
+
+// A frame copied out of AE, so the background writer can
+// compress it while AE goes on to render the next one.
+class FrameWriteJob : public BackgroundJobs::Job
+{
+  public:
+	FrameWriteJob(const A_PathType *file_pathZ, const Header &header, const FloatARGB &frame, Imf::PixelType pix_type, bool alpha);
+	virtual ~FrameWriteJob() {}
+	
+	virtual void run();
+	
+  private:
+	PathString _path;
+	Header _header;
+	Array<char> _pixels;
+	FloatARGB _frame;
+	Imf::PixelType _pix_type;
+	bool _alpha;
+};
+
+
+FrameWriteJob::FrameWriteJob(const A_PathType *file_pathZ, const Header &header, const FloatARGB &frame, Imf::PixelType pix_type, bool alpha) :
+	_path(file_pathZ),
+	_header(header),
+	_pix_type(pix_type),
+	_alpha(alpha)
+{
+	const size_t rowbytes = sizeof(float) * 4 * frame.width;
+	
+	_pixels.resizeErase(rowbytes * frame.height);
+	
+	for(int y=0; y < frame.height; y++)
+	{
+		memcpy(&_pixels[y * rowbytes], frame.data + (y * frame.rowbytes), rowbytes);
+	}
+	
+	_frame.data = &_pixels[0];
+	_frame.rowbytes = rowbytes;
+	_frame.width = frame.width;
+	_frame.height = frame.height;
+}
+
+
+void
+FrameWriteJob::run()
+{
+	gFileCache.forgetFile( _path.string() ); // might have been drawn since it was queued
+	
+	WriteFloatARGBFile(_path.string(), _header, _frame, _pix_type, _alpha);
+}
+
+
+typedef struct {
+	const void *in;
 	size_t in_rowbytes;
-	void *out;
-	size_t out_rowbytes;
+	Rgba *out;
+	int first_row;
 	int width;
-} FloatToHalfData;
+	int data_width;
+	bool has_alpha;
+} FloatToRgbaData;
 
 static A_Err
-FloatToHalf_Iterate(
+FloatToRgba_Iterate(
 	void	*refconPV,
 	A_long	thread_indexL,
 	A_long	i,
@@ -2127,18 +3138,28 @@ FloatToHalf_Iterate(
 {
 	A_Err err = A_Err_NONE;
 	
-	FloatToHalfData *i_data = (FloatToHalfData *)refconPV;
-	
-	float *in = (float *)((char *)i_data->in + (i * i_data->in_rowbytes));
-	half *out = (half *)((char *)i_data->out + (i * i_data->out_rowbytes));
+	FloatToRgbaData *i_data = (FloatToRgbaData *)refconPV;
 	
-	int width = 4 * i_data->width;
+	const PF_Pixel32 *pixel = (const PF_Pixel32 *)((const char *)i_data->in + ((i_data->first_row + i) * i_data->in_rowbytes));
+	Rgba *out = i_data->out + (i * i_data->data_width);
 	
-	while(width--)
+	for(int x=0; x < i_data->width; ++x)
 	{
-		*out++ = *in++;
+		out[x].r = pixel->red;
+		out[x].g = pixel->green;
+		out[x].b = pixel->blue;
+		
+		if(i_data->has_alpha)
+			out[x].a = pixel->alpha;
+		else
+			out[x].a = half(1.0);
+		
+		pixel++;
 	}
 	
+	if( i_data->data_width == (i_data->width + 1) ) // duplicate last pixel (for Luminance/Chroma)
+	{	out[i_data->data_width - 1] = out[i_data->width - 1];	}
+	
 	return err;
 }
 
@@ -2163,11 +3184,12 @@ OpenEXR_OutputFile(
 	
 	AEGP_SuiteHandler suites(basic_dataP->pica_basicP);
 		
-	AEGP_WorldH temp_worldH = NULL;
-		
 
 	try{
 	
+	// we might be writing over a file we've been reading
+	gFileCache.forgetFile(file_pathZ);
+	
 	if( IlmThread::supportsThreads() )
 		setGlobalThreadCount(gNumCPUs);
 
@@ -2282,119 +3304,108 @@ OpenEXR_OutputFile(
 										(info->planes == 4) ? (options->luminance_chroma ? WRITE_YCA : WRITE_RGBA) :
 										WRITE_RGBA; // ummm?
 		
-		OStreamPlatform outstream(file_pathZ);
-		RgbaOutputFile	outputFile(outstream, header, rgba_channels);
-		
-
-		// scanline buffer
-		Array2D<Rgba> half_buffer(1, data_width);
-		
-
-		// AE buffer
-		A_u_char *row = (A_u_char *)wP->data;
-		
-		PF_Pixel32 *pixel;
-		
+		OStreamPlatform outstream(file_pathZ, gWriteBehind);
 		
-		for(int y=0; y < info->height; ++y)
+		if(true) // the file has to be closed before we finish the stream
 		{
-			pixel = (PF_Pixel32 *)row;
+			RgbaOutputFile	outputFile(outstream, header, rgba_channels);
+			
+			
+			// convert and write a band of lines at a time, so OpenEXR can compress in parallel
+			const int band_rows = min(OutputBlockSize(header), data_height);
+			
+			Array2D<Rgba> half_buffer(band_rows, data_width);
+			
 			
-			for(int x=0; x < info->width; ++x)
+			for(int y=0; y < data_height && !err; y += band_rows)
 			{
-				half_buffer[0][x].r = pixel->red;
-				half_buffer[0][x].g = pixel->green;
-				half_buffer[0][x].b = pixel->blue;
+				const int rows = min(band_rows, data_height - y);
 				
-				if(info->planes == 4)
-					half_buffer[0][x].a = pixel->alpha;
-				else
-					half_buffer[0][x].a = half(1.0);
+				// for Luminance/Chroma the file might have one more line than AE
+				const int ae_rows = min(rows, info->height - y);
+				
+				FloatToRgbaData i_data = { wP->data, wP->rowbytes, &half_buffer[0][0], y,
+											info->width, data_width, (info->planes == 4) };
+				
+				if(ae_rows > 0)
+					err = suites.AEGPIterateSuite()->AEGP_IterateGeneric(ae_rows, (void *)&i_data, FloatToRgba_Iterate);
 				
-				pixel++;
+				// write an extra duplicate line if necessary (for Luminance/Chroma)
+				if(ae_rows < rows)
+				{
+					// if the band is only the extra line, the last one is still here from the band before
+					const int last_row = (ae_rows > 0 ? ae_rows - 1 : band_rows - 1);
+					
+					for(int x=0; x < data_width; x++)
+						half_buffer[ae_rows][x] = half_buffer[last_row][x];
+				}
+				
+				outputFile.setFrameBuffer(&half_buffer[-y][0], 1, data_width);
+				outputFile.writePixels(rows);
 			}
-			
-			if( data_width == (info->width + 1) ) // duplicate last pixel (for Luminance/Chroma)
-			{	half_buffer[0][data_width - 1] = half_buffer[0][info->width - 1];	}
-			
-			// write scanline
-			outputFile.setFrameBuffer(&half_buffer[-y][0], 1, data_width);
-			outputFile.writePixels(1);
-			
-			row += wP->rowbytes;	
 		}
 		
-		
-		// write an extra duplicate line if necessary (for Luminance/Chroma)
-		if( data_height == (info->height + 1) )
-		{
-			outputFile.setFrameBuffer(&half_buffer[1 - data_height][0], 1, data_width);
-			outputFile.writePixels(1);
-		}
+		outstream.finish();
 	}
 	else
 	{
 		Imf::PixelType pix_type = (options->float_not_half ? Imf::FLOAT : Imf::HALF);
-		size_t pix_size = (pix_type == Imf::FLOAT ? sizeof(float) : sizeof(half));
-		
-		void *buf_origin = wP->data;
-		size_t rowbytes = wP->rowbytes;
 		
-		
-		// have to make a half buffer ourselves
-		if(pix_type == Imf::HALF)
-		{
-			suites.AEGPWorldSuite()->AEGP_New(S_mem_id, AEGP_WorldType_16, data_width, data_height, &temp_worldH);
-			
-			A_u_long temp_rowbytes;
-			suites.AEGPWorldSuite()->AEGP_GetRowBytes(temp_worldH, &temp_rowbytes);
-			rowbytes = temp_rowbytes;
-			
-			PF_Pixel16 *base = NULL;
-			suites.AEGPWorldSuite()->AEGP_GetBaseAddr16(temp_worldH, &base);
-			buf_origin = (void *)base;
-			
-			FloatToHalfData i_data = { wP->data, wP->rowbytes, (void *)base, temp_rowbytes, data_width };
-			
-			err = suites.AEGPIterateSuite()->AEGP_IterateGeneric(data_height, (void *)&i_data, FloatToHalf_Iterate);
-		}
+		const bool alpha = (info->planes == 4);
 		
 		
 		header.channels().insert("R", Channel(pix_type));
 		header.channels().insert("G", Channel(pix_type));
 		header.channels().insert("B", Channel(pix_type));
 		
-		if(info->planes == 4)
+		if(alpha)
 			header.channels().insert("A", Channel(pix_type));
 		
-		
-		FrameBuffer frameBuffer;
-		
-		frameBuffer.insert("R", Slice(pix_type, (char *)buf_origin + (pix_size * 1), pix_size * 4, rowbytes) );
-		frameBuffer.insert("G", Slice(pix_type, (char *)buf_origin + (pix_size * 2), pix_size * 4, rowbytes) );
-		frameBuffer.insert("B", Slice(pix_type, (char *)buf_origin + (pix_size * 3), pix_size * 4, rowbytes) );
-		
-		if(info->planes == 4)
-			frameBuffer.insert("A", Slice(pix_type, (char *)buf_origin + (pix_size * 0), pix_size * 4, rowbytes) );
+		if(options->tiles != TILES_NONE)
+		{
+			const int tile_size = 1 << (options->tile_size_log2 ? options->tile_size_log2 : TILE_SIZE_DEFAULT_LOG2);
+			
+			const LevelMode level_mode = (options->tiles == TILES_MIPMAP ? MIPMAP_LEVELS :
+											options->tiles == TILES_RIPMAP ? RIPMAP_LEVELS :
+											ONE_LEVEL);
+			
+			header.setTileDescription( TileDescription(tile_size, tile_size, level_mode, ROUND_DOWN) );
+		}
 		
 		
-		OStreamPlatform outstream(file_pathZ);
-		OutputFile file(outstream, header);
+		FloatARGB frame = { (const char *)wP->data, (size_t)wP->rowbytes, data_width, data_height };
 		
-		file.setFrameBuffer(frameBuffer);
-		file.writePixels(data_height);
+		if( gBackgroundWriter.running() )
+		{
+			// waits if too many frames are already queued,
+			// throws if one of them couldn't be written
+			gBackgroundWriter.queue( new FrameWriteJob(file_pathZ, header, frame, pix_type, alpha) );
+		}
+		else
+			WriteFloatARGBFile(file_pathZ, header, frame, pix_type, alpha);
 	}
 	
 
 	}catch(...) { err = AEIO_Err_DISK_FULL; }
-
-		
-	if(temp_worldH)
-		suites.AEGPWorldSuite()->AEGP_Dispose(temp_worldH);
 	
 	return err;
 }
 
+
+A_Err
+OpenEXR_FinishOutput(
+	AEIO_BasicData		*basic_dataP)
+{
+	// wait for the background writer, and find out if it had any trouble
+	try
+	{
+		gBackgroundWriter.finish();
+	}
+	catch(...) { return AEIO_Err_DISK_FULL; }
+	
+	return A_Err_NONE;
+}
+
 A_Err	
 OpenEXR_WriteOptionsDialog(
 	AEIO_BasicData		*basic_dataP,
@@ -2472,6 +3483,16 @@ OpenEXR_GetOutSpecInfo(
 	else if(options->float_not_half)
 		strcat(verbiageP->sub_type, "\n32-bit float");
 	
+	if(!options->luminance_chroma)
+	{
+		if(options->tiles == TILES_ONE_LEVEL)
+			strcat(verbiageP->sub_type, "\nTiled");
+		else if(options->tiles == TILES_MIPMAP)
+			strcat(verbiageP->sub_type, "\nTiled with mipmaps");
+		else if(options->tiles == TILES_RIPMAP)
+			strcat(verbiageP->sub_type, "\nTiled with ripmaps");
+	}
+	
 	return err;
 }
 
@@ -37,12 +37,26 @@ typedef struct OpenEXR_inData
 
 
 
+enum {
+	TILES_NONE = 0,
+	TILES_ONE_LEVEL,
+	TILES_MIPMAP,
+	TILES_RIPMAP
+};
+typedef A_u_char TileMode;
+
+#define TILE_SIZE_MIN_LOG2		5 // 32 pixels
+#define TILE_SIZE_MAX_LOG2		8 // 256 pixels
+#define TILE_SIZE_DEFAULT_LOG2	6 // 64 pixels, also used when it's 0
+
 typedef struct OpenEXR_outData
 {
 	A_u_char	compression_type;
 	A_Boolean	float_not_half;
 	A_Boolean	luminance_chroma;
-	char		reserved[61]; // total of 64 bytes
+	TileMode	tiles; // Luminance/Chroma has to be scanlines
+	A_u_char	tile_size_log2;
+	char		reserved[59]; // total of 64 bytes
 } OpenEXR_outData;
 
 
@@ -85,6 +99,7 @@ A_Err
 OpenEXR_DrawSparseFrame(
 	AEIO_BasicData					*basic_dataP,
 	const AEIO_DrawSparseFramePB	*sparse_framePPB, 
+	PF_Point						scale,
 	PF_EffectWorld					*wP,
 	AEIO_DrawingFlags				*draw_flagsP,
 	const A_PathType				*file_pathZ,
@@ -168,6 +183,10 @@ OpenEXR_OutputFile(
 	OpenEXR_outData	*options,
 	PF_EffectWorld		*wP);
 
+A_Err
+OpenEXR_FinishOutput(
+	AEIO_BasicData		*basic_dataP);
+
 A_Err	
 OpenEXR_WriteOptionsDialog(
 	AEIO_BasicData		*basic_dataP,
@@ -8,6 +8,8 @@
 
 #include "OpenEXR_ChannelCache.h"
 
+#include "OpenEXR_SIMD.h"
+
 #include <half.h>
 #include <ImfChannelList.h>
 #include <IexBaseExc.h>
@@ -81,9 +83,21 @@ FixSubsampling(const FrameBuffer &framebuffer, const Box2i &dw)
 }
 
 
-OpenEXR_ChannelCache::OpenEXR_ChannelCache(const SPBasicSuite *pica_basicP, const AEIO_InterruptFuncs *inter,
+static size_t
+PixelSize(Imf::PixelType pix_type)
+{
+	return	pix_type == Imf::HALF ? sizeof(half) :
+			pix_type == Imf::FLOAT ? sizeof(float) :
+			pix_type == Imf::UINT ? sizeof(unsigned int) :
+			sizeof(float);
+}
+
+
+OpenEXR_ChannelCache::OpenEXR_ChannelCache(const SPBasicSuite *pica_basicP, OpenEXR_CachePool &pool,
 											HybridInputFile &in, const IStreamPlatform &stream) :
 	suites(pica_basicP),
+	_pool(pool),
+	_bytes(0),
 	_path(stream.getPath()),
 	_modtime(stream.getModTime())
 {
@@ -92,26 +106,70 @@ OpenEXR_ChannelCache::OpenEXR_ChannelCache(const SPBasicSuite *pica_basicP, cons
 	_width = dw.max.x - dw.min.x + 1;
 	_height = dw.max.y - dw.min.y + 1;
 	
+	// channels get loaded when fillFrameBuffer() first asks for them
+	
+	updateCacheTime();
+}
+
+
+void
+OpenEXR_ChannelCache::deleteChannels(const vector<string> &names)
+{
+	for(vector<string>::const_iterator i = names.begin(); i != names.end(); ++i)
+	{
+		ChannelMap::iterator chan = _cache.find(*i);
+		
+		if(chan != _cache.end())
+		{
+			if(chan->second.bufH != NULL)
+			{
+				suites.MemorySuite()->AEGP_FreeMemHandle(chan->second.bufH);
+				
+				_bytes -= PixelSize(chan->second.pix_type) * _width * _height;
+			}
+			
+			_cache.erase(chan);
+		}
+	}
+}
+
+
+bool
+OpenEXR_ChannelCache::loadChannels(HybridInputFile &in, const FrameBuffer &framebuffer, const AEIO_InterruptFuncs *inter)
+{
+	const Box2i &dw = in.dataWindow();
+	
+	assert(_width == dw.max.x - dw.min.x + 1);
+	assert(_height == dw.max.y - dw.min.y + 1);
+	
 	
 	FrameBuffer frameBuffer;
 	
+	vector<string> new_channels;
+	
 	try
 	{
 		const ChannelList &channels = in.channels();
 		
-		for(ChannelList::ConstIterator i = channels.begin(); i != channels.end(); ++i)
+		for(FrameBuffer::ConstIterator i = framebuffer.begin(); i != framebuffer.end(); ++i)
 		{
-			const Channel &channel = i.channel();
+			const Channel *channel = channels.findChannel( i.name() );
+			
+			// channels not in the file just get filled
+			if(channel == NULL || _cache.find( i.name() ) != _cache.end())
+				continue;
+			
 			
-			const size_t pix_size =	channel.type == Imf::HALF ? sizeof(half) :
-									channel.type == Imf::FLOAT ? sizeof(float) :
-									channel.type == Imf::UINT ? sizeof(unsigned int) :
-									sizeof(float);
+			const size_t pix_size = PixelSize(channel->type);
 									
 			const size_t rowbytes = pix_size * _width;
 			const size_t data_size = rowbytes * _height;
 			
 			
+			if( !_pool.makeRoom(this, data_size) )
+				throw BaseExc("Channel cache would be over the memory limit.");
+			
+			
 			AEIO_Handle bufH = NULL;
 			
 			suites.MemorySuite()->AEGP_NewMemHandle(S_mem_id, "Channel Cache",
@@ -122,7 +180,11 @@ OpenEXR_ChannelCache::OpenEXR_ChannelCache(const SPBasicSuite *pica_basicP, cons
 				throw NullExc("Can't allocate a channel cache handle like I need to.");
 			
 			
-			_cache[ i.name() ] = ChannelCache(channel.type, bufH);
+			_cache[ i.name() ] = ChannelCache(channel->type, bufH);
+			
+			_bytes += data_size;
+			
+			new_channels.push_back( i.name() );
 			
 			
 			char *buf = NULL;
@@ -135,16 +197,20 @@ OpenEXR_ChannelCache::OpenEXR_ChannelCache(const SPBasicSuite *pica_basicP, cons
 			
 			char * const channel_origin = buf - (pix_size * dw.min.x) - (rowbytes * dw.min.y);
 			
-			frameBuffer.insert(i.name(), Slice(	channel.type,
+			frameBuffer.insert(i.name(), Slice(	channel->type,
 												channel_origin,
 												pix_size,
 												rowbytes,
-												channel.xSampling,
-												channel.ySampling,
+												channel->xSampling,
+												channel->ySampling,
 												0.0) );
 		}
 		
 		
+		if( new_channels.empty() )
+			return true;
+		
+		
 		in.setFrameBuffer(frameBuffer);
 		
 	
@@ -178,35 +244,35 @@ OpenEXR_ChannelCache::OpenEXR_ChannelCache(const SPBasicSuite *pica_basicP, cons
 	}
 	catch(IoExc) {} // we catch these so that partial files are read partially without error
 	catch(InputExc) {}
-	catch(...)
+	catch(CancelExc)
 	{
-		// out of memory or worse; kill anything that got allocated
-		for(ChannelMap::iterator i = _cache.begin(); i != _cache.end(); ++i)
-		{
-			if(i->second.bufH != NULL)
-			{
-				suites.MemorySuite()->AEGP_FreeMemHandle(i->second.bufH);
-				
-				i->second.bufH = NULL;
-			}
-		}
+		deleteChannels(new_channels);
 		
 		throw; // re-throw the exception
 	}
+	catch(...)
+	{
+		// out of memory or worse; kill the channels we were loading
+		// and let the caller read the file directly
+		deleteChannels(new_channels);
+		
+		return false;
+	}
 	
 
 	
 	FixSubsampling(frameBuffer, dw);
 	
 	
-	for(ChannelMap::const_iterator i = _cache.begin(); i != _cache.end(); ++i)
+	for(vector<string>::const_iterator i = new_channels.begin(); i != new_channels.end(); ++i)
 	{
-		if(i->second.bufH != NULL)
-			suites.MemorySuite()->AEGP_UnlockMemHandle(i->second.bufH);
+		const ChannelCache &chan = _cache[*i];
+		
+		if(chan.bufH != NULL)
+			suites.MemorySuite()->AEGP_UnlockMemHandle(chan.bufH);
 	}
 	
-	
-	updateCacheTime();
+	return true;
 }
 
 
@@ -224,211 +290,317 @@ OpenEXR_ChannelCache::~OpenEXR_ChannelCache()
 }
 
 
-class CopyCacheTask : public Task
-{
-  public:
-	CopyCacheTask(TaskGroup *group,
-					const char *buf, int width, Imf::PixelType pix_type,
-					const Slice &slice, const Box2i &dw, int row);
-	virtual ~CopyCacheTask() {}
+// what one slice of the frame buffer gets, a channel from the cache or its fill value
+typedef struct CacheCopy {
+	const Slice		*slice;
+	const char		*buf; // NULL to fill
+	Imf::PixelType	pix_type;
 	
-	virtual void execute();
-	
-	template <typename INTYPE, typename OUTTYPE>
-	static void CopyRow(const char *in, char *out, size_t out_stride, int width);
-	
-  private:
-	const char *_buf;
-	int _width;
-	Imf::PixelType _pix_type;
-	const Slice &_slice;
-	const Box2i &_dw;
-	int _row;
-};
-
+	CacheCopy(const Slice *s, const char *b, Imf::PixelType t) : slice(s), buf(b), pix_type(t) {}
+} CacheCopy;
 
-CopyCacheTask::CopyCacheTask(TaskGroup *group,
-								const char *buf, int width, Imf::PixelType pix_type,
-								const Slice &slice, const Box2i &dw, int row) :
-	Task(group),
-	_buf(buf),
-	_width(width),
-	_pix_type(pix_type),
-	_slice(slice),
-	_dw(dw),
-	_row(row)
-{
-
-}
 
-
-void
-CopyCacheTask::execute()
+template <typename INTYPE, typename OUTTYPE>
+static void
+CopyRow(const char *in, char *out, size_t out_stride, int width)
 {
-	const size_t pix_size =	_pix_type == Imf::HALF ? sizeof(half) :
-							_pix_type == Imf::FLOAT ? sizeof(float) :
-							_pix_type == Imf::UINT ? sizeof(unsigned int) :
-							sizeof(float);
-							
-	const size_t rowbytes = pix_size * _width;
-	
-	const char *in_row = _buf + (rowbytes * _row);
-				
-	char *slice_row = _slice.base + (_slice.yStride * (_dw.min.y + _row)) + (_slice.xStride * _dw.min.x);
+	INTYPE *i = (INTYPE *)in;
+	OUTTYPE *o = (OUTTYPE *)out;
 	
-	if(_pix_type == Imf::HALF)
-	{
-		assert(_slice.type == Imf::FLOAT);
-		
-		CopyRow<half, float>(in_row, slice_row, _slice.xStride, _width);
-	}
-	else if(_pix_type == Imf::FLOAT)
-	{
-		assert(_slice.type == Imf::FLOAT);
-		
-		CopyRow<float, float>(in_row, slice_row, _slice.xStride, _width);
-	}
-	else if(_pix_type == Imf::UINT)
+	int o_step = out_stride / sizeof(OUTTYPE);
+	
+	while(width--)
 	{
-		assert(_slice.type == Imf::UINT);
+		*o = *i++;
 		
-		CopyRow<unsigned int, unsigned int>(in_row, slice_row, _slice.xStride, _width);
+		o += o_step;
 	}
 }
 
 
-template <typename INTYPE, typename OUTTYPE>
-void
-CopyCacheTask::CopyRow(const char *in, char *out, size_t out_stride, int width)
+template <typename OUTTYPE>
+static void
+FillRow(char *out, size_t out_stride, int width, double val)
 {
-	INTYPE *i = (INTYPE *)in;
 	OUTTYPE *o = (OUTTYPE *)out;
 	
 	int o_step = out_stride / sizeof(OUTTYPE);
 	
 	while(width--)
 	{
-		*o = *i++;
+		*o = val;
 		
 		o += o_step;
 	}
 }
 
 
-class FillSliceTask : public Task
+static void
+CopyCacheRow(const CacheCopy &copy, int width, const Box2i &dw, const Box2i &region, int row)
 {
-  public:
-	FillSliceTask(TaskGroup *group, const Slice &slice, const Box2i &dw, int row);
-	virtual ~FillSliceTask() {}
+	const Slice &slice = *copy.slice;
 	
-	virtual void execute();
+	char *slice_row = slice.base + (slice.yStride * (dw.min.y + row)) + (slice.xStride * region.min.x);
 	
-	template <typename OUTTYPE>
-	static void FillRow(char *out, size_t out_stride, int width, double val);
+	const int copy_width = region.max.x - region.min.x + 1;
 	
-  private:
-	const Slice &_slice;
-	const Box2i &_dw;
-	int _row;
-};
-
+	if(copy.buf == NULL)
+	{
+		if(slice.type == Imf::FLOAT)
+		{
+			FillRow<float>(slice_row, slice.xStride, copy_width, slice.fillValue);
+		}
+		else if (slice.type == Imf::UINT)
+		{
+			FillRow<unsigned int>(slice_row, slice.xStride, copy_width, slice.fillValue);
+		}
+	}
+	else
+	{
+		const size_t pix_size =	copy.pix_type == Imf::HALF ? sizeof(half) :
+								copy.pix_type == Imf::FLOAT ? sizeof(float) :
+								copy.pix_type == Imf::UINT ? sizeof(unsigned int) :
+								sizeof(float);
+		
+		const size_t rowbytes = pix_size * width;
+		
+		const char *in_row = copy.buf + (rowbytes * row) + (pix_size * (region.min.x - dw.min.x));
+		
+		if(copy.pix_type == Imf::HALF)
+		{
+			assert(slice.type == Imf::FLOAT);
+			
+			HalfToFloatRow((const half *)in_row, (float *)slice_row, slice.xStride / sizeof(float), copy_width);
+		}
+		else if(copy.pix_type == Imf::FLOAT)
+		{
+			assert(slice.type == Imf::FLOAT);
+			
+			CopyRow<float, float>(in_row, slice_row, slice.xStride, copy_width);
+		}
+		else if(copy.pix_type == Imf::UINT)
+		{
+			assert(slice.type == Imf::UINT);
+			
+			CopyRow<unsigned int, unsigned int>(in_row, slice_row, slice.xStride, copy_width);
+		}
+	}
+}
 
-FillSliceTask::FillSliceTask(TaskGroup *group, const Slice &slice, const Box2i &dw, int row) :
-	Task(group),
-	_slice(slice),
-	_dw(dw),
-	_row(row)
-{
 
-}
+// A band of rows for every channel.  fillFrameBuffer() keeps these
+// for the length of the copy, the tasks just point at them.
+typedef struct CopyCacheBand {
+	const vector<CacheCopy>	*copies;
+	const CacheCopy * const	*interleaved;
+	int						width;
+	const Box2i				*dw;
+	const Box2i				*region;
+	int						first_row;
+	int						last_row;
+} CopyCacheBand;
 
 
-void
-FillSliceTask::execute()
+static void
+CopyBand(const CopyCacheBand &band)
 {
-	char *slice_row = _slice.base + (_slice.yStride * (_dw.min.y + _row)) + (_slice.xStride * _dw.min.x);
+	const Box2i &dw = *band.dw;
+	const Box2i &region = *band.region;
 	
-	int width = _dw.max.x - _dw.min.x + 1;
-	
-	if(_slice.type == Imf::FLOAT)
+	if(band.interleaved)
 	{
-		FillRow<float>(slice_row, _slice.xStride, width, _slice.fillValue);
+		// half channels going to one float pixel, convert and interleave them in one pass
+		const Slice &first_slice = *band.interleaved[0]->slice;
+		
+		const int copy_width = region.max.x - region.min.x + 1;
+		
+		float fill[4];
+		
+		for(int c=0; c < 4; c++)
+			fill[c] = band.interleaved[c]->slice->fillValue;
+		
+		for(int row = band.first_row; row <= band.last_row; row++)
+		{
+			const half *in[4];
+			
+			for(int c=0; c < 4; c++)
+			{
+				const char *buf = band.interleaved[c]->buf;
+				
+				in[c] = (buf == NULL ? NULL : (const half *)buf + ((size_t)band.width * row) + (region.min.x - dw.min.x));
+			}
+			
+			float *out = (float *)(first_slice.base + (first_slice.yStride * (dw.min.y + row)) + (first_slice.xStride * region.min.x));
+			
+			HalfToFloatInterleave(in, fill, out, copy_width);
+		}
+		
+		return;
 	}
-	else if (_slice.type == Imf::UINT)
+	
+	
+	// all the channels of a row together, they're usually interleaved in the same buffer
+	for(int row = band.first_row; row <= band.last_row; row++)
 	{
-		FillRow<unsigned int>(slice_row, _slice.xStride, width, _slice.fillValue);
+		for(vector<CacheCopy>::const_iterator i = band.copies->begin(); i != band.copies->end(); ++i)
+		{
+			CopyCacheRow(*i, band.width, dw, region, row);
+		}
 	}
 }
 
 
-template <typename OUTTYPE>
-void
-FillSliceTask::FillRow(char *out, size_t out_stride, int width, double val)
+class CopyCacheBandTask : public Task
 {
-	OUTTYPE *o = (OUTTYPE *)out;
+  public:
+	CopyCacheBandTask(TaskGroup *group, const CopyCacheBand &band) : Task(group), _band(band) {}
+	virtual ~CopyCacheBandTask() {}
 	
-	int o_step = out_stride / sizeof(OUTTYPE);
+	virtual void execute() { CopyBand(_band); }
+
+  private:
+	const CopyCacheBand &_band;
+};
+
+
+// If the frame buffer is four float slices of the same pixel (like AE's ARGB world)
+// and the cache has them as half (or doesn't have them), put them in pixel order.
+static bool
+FindInterleavedHalf(const vector<CacheCopy> &copies, const CacheCopy *interleaved[4])
+{
+	if(copies.size() != 4)
+		return false;
 	
-	while(width--)
+	const Slice *first = NULL;
+	
+	for(vector<CacheCopy>::const_iterator i = copies.begin(); i != copies.end(); ++i)
 	{
-		*o = val;
+		if(first == NULL || i->slice->base < first->base)
+			first = i->slice;
+	}
+	
+	for(int c=0; c < 4; c++)
+		interleaved[c] = NULL;
+	
+	for(vector<CacheCopy>::const_iterator i = copies.begin(); i != copies.end(); ++i)
+	{
+		const Slice &slice = *i->slice;
 		
-		o += o_step;
+		if(slice.type != Imf::FLOAT ||
+			slice.xStride != sizeof(float) * 4 ||
+			slice.yStride != first->yStride ||
+			(i->buf != NULL && i->pix_type != Imf::HALF) )
+		{
+			return false;
+		}
+		
+		const ptrdiff_t offset = slice.base - first->base;
+		
+		if(offset % sizeof(float) != 0 || offset / sizeof(float) >= 4)
+			return false;
+		
+		const int c = offset / sizeof(float);
+		
+		if(interleaved[c] != NULL)
+			return false;
+		
+		interleaved[c] = &*i;
 	}
+	
+	return true;
 }
 
 
-void
-OpenEXR_ChannelCache::fillFrameBuffer(const FrameBuffer &framebuffer, const Box2i &dw)
+bool
+OpenEXR_ChannelCache::fillFrameBuffer(HybridInputFile &in, const FrameBuffer &framebuffer, const Box2i &dw,
+										const Box2i &region, const AEIO_InterruptFuncs *inter)
 {
+	if( !loadChannels(in, framebuffer, inter) )
+		return false;
+	
+	
 	vector<AEIO_Handle> locked_handles;
-
-	if(true) // making a scope for TaskGroup
-	{
-		TaskGroup group;
 	
-		for(FrameBuffer::ConstIterator i = framebuffer.begin(); i != framebuffer.end(); ++i)
+	assert(region.min.x >= dw.min.x && region.max.x <= dw.max.x);
+	assert(region.min.y >= dw.min.y && region.max.y <= dw.max.y);
+	assert(_width == dw.max.x - dw.min.x + 1);
+	assert(_height == dw.max.y - dw.min.y + 1);
+	
+	
+	vector<CacheCopy> copies;
+	
+	for(FrameBuffer::ConstIterator i = framebuffer.begin(); i != framebuffer.end(); ++i)
+	{
+		const Slice &slice = i.slice();
+		
+		assert(slice.xSampling == 1 && slice.ySampling == 1);
+		
+		ChannelMap::const_iterator cache = _cache.find( i.name() );
+		
+		if( cache == _cache.end() )
 		{
-			const Slice &slice = i.slice();
+			// don't have this channel, fill with the fill value
+			copies.push_back( CacheCopy(&slice, NULL, slice.type) );
+		}
+		else
+		{
+			if(cache->second.bufH == NULL)
+				throw NullExc("Why is the handle NULL?");
+			
+			
+			char *buf = NULL;
+			
+			suites.MemorySuite()->AEGP_LockMemHandle(cache->second.bufH, (void**)&buf);
+			
+			
+			if(buf == NULL)
+				throw NullExc("Why is the locked handle NULL?");
 			
-			assert(slice.xSampling == 1 && slice.ySampling == 1);
-			assert(_width == dw.max.x - dw.min.x + 1);
-			assert(_height == dw.max.y - dw.min.y + 1);
+			locked_handles.push_back(cache->second.bufH);
 			
-			ChannelMap::const_iterator cache = _cache.find( i.name() );
+			copies.push_back( CacheCopy(&slice, buf, cache->second.pix_type) );
+		}
+	}
+	
+	
+	// only rows inside the region get copied, a few bands per thread
+	const int first_row = region.min.y - dw.min.y;
+	const int last_row = region.max.y - dw.min.y;
+	
+	const int num_rows = last_row - first_row + 1;
+	
+	const int num_bands = min(num_rows, max(globalThreadCount(), 1) * 4);
+	
+	const int band_rows = (num_rows + num_bands - 1) / num_bands;
+	
+	const CacheCopy *interleaved[4];
+	
+	const bool use_interleaved = FindInterleavedHalf(copies, interleaved);
+	
+	vector<CopyCacheBand> bands;
+	
+	for(int y = first_row; y <= last_row; y += band_rows)
+	{
+		CopyCacheBand band;
 		
-			if( cache == _cache.end() )
-			{
-				// don't have this channel, fill with the fill value
-				for(int y=0; y < _height; y++)
-				{
-					ThreadPool::addGlobalTask(new FillSliceTask(&group, slice, dw, y) );
-				}
-			}
-			else
-			{
-				if(cache->second.bufH == NULL)
-					throw NullExc("Why is the handle NULL?");
-				
-				
-				char *buf = NULL;
-				
-				suites.MemorySuite()->AEGP_LockMemHandle(cache->second.bufH, (void**)&buf);
-				
-				
-				if(buf == NULL)
-					throw NullExc("Why is the locked handle NULL?");
-				
-				locked_handles.push_back(cache->second.bufH);
-				
-				
-				for(int y=0; y < _height; y++)
-				{
-					ThreadPool::addGlobalTask(new CopyCacheTask(&group,
-															buf, _width, cache->second.pix_type,
-															slice, dw, y) );
-				}
-			}
+		band.copies = &copies;
+		band.interleaved = (use_interleaved ? interleaved : NULL);
+		band.width = _width;
+		band.dw = &dw;
+		band.region = &region;
+		band.first_row = y;
+		band.last_row = min(y + band_rows - 1, last_row);
+		
+		bands.push_back(band);
+	}
+	
+	if(true) // making a scope for TaskGroup
+	{
+		TaskGroup group;
+		
+		for(vector<CopyCacheBand>::const_iterator i = bands.begin(); i != bands.end(); ++i)
+		{
+			ThreadPool::addGlobalTask( new CopyCacheBandTask(&group, *i) );
 		}
 	}
 	
@@ -440,6 +612,8 @@ OpenEXR_ChannelCache::fillFrameBuffer(const FrameBuffer &framebuffer, const Box2
 	
 	
 	updateCacheTime();
+	
+	return true;
 }
 
 
@@ -467,6 +641,7 @@ OpenEXR_ChannelCache::cacheIsStale(int timeout) const
 
 OpenEXR_CachePool::OpenEXR_CachePool() :
 	_max_caches(0),
+	_max_bytes(0),
 	_pica_basicP(NULL)
 {
 
@@ -475,59 +650,69 @@ OpenEXR_CachePool::OpenEXR_CachePool() :
 
 OpenEXR_CachePool::~OpenEXR_CachePool()
 {
-	configurePool(0, NULL);
-}
-
-
-static bool
-compare_age(const OpenEXR_ChannelCache *first, const OpenEXR_ChannelCache *second)
-{
-	return first->cacheAge() > second->cacheAge();
+	configurePool(0, 0, NULL);
 }
 
 
 void
-OpenEXR_CachePool::configurePool(int max_caches, const SPBasicSuite *pica_basicP)
+OpenEXR_CachePool::configurePool(int max_caches, size_t max_bytes, const SPBasicSuite *pica_basicP)
 {
 	_max_caches = max_caches;
+	_max_bytes = max_bytes;
 	
 	if(pica_basicP)
 		_pica_basicP = pica_basicP;
 	
-	_pool.sort(compare_age);
-
-	while(_pool.size() > _max_caches)
-	{
-		delete _pool.front();
-		
-		_pool.pop_front();
-	}
+	trimPool(_max_caches, _max_bytes);
 }
 
 
-static bool
-MatchDateTime(const DateTime &d1, const DateTime &d2)
+// FNV-1a of the path and mod time
+static size_t
+CacheKey(const PathString &path, const DateTime &modtime)
 {
+	size_t hash = 2166136261u;
+	
+	for(const A_PathType *c = path.string(); c != NULL && *c != 0; c++)
+	{
+		hash ^= (size_t)*c;
+		hash *= 16777619u;
+	}
+	
 #ifdef __APPLE__
-	return (d1.fraction == d2.fraction &&
-			d1.lowSeconds == d2.lowSeconds &&
-			d1.highSeconds == d2.highSeconds);
+	const size_t time_fields[3] = { modtime.highSeconds, modtime.lowSeconds, modtime.fraction };
+#elif defined(WIN32)
+	const size_t time_fields[2] = { modtime.dwHighDateTime, modtime.dwLowDateTime };
 #else
-	return (d1.dwHighDateTime == d2.dwHighDateTime &&
-			d1.dwLowDateTime == d2.dwLowDateTime);
+	const size_t time_fields[2] = { (size_t)modtime.tv_sec, (size_t)modtime.tv_nsec };
 #endif
+	
+	for(size_t i=0; i < sizeof(time_fields) / sizeof(time_fields[0]); i++)
+	{
+		hash ^= time_fields[i];
+		hash *= 16777619u;
+	}
+	
+	return hash;
 }
 
 
 OpenEXR_ChannelCache *
-OpenEXR_CachePool::findCache(const IStreamPlatform &stream) const
+OpenEXR_CachePool::findCache(const IStreamPlatform &stream)
 {
-	for(list<OpenEXR_ChannelCache *>::const_iterator i = _pool.begin(); i != _pool.end(); ++i)
+	const pair<CacheIndex::const_iterator, CacheIndex::const_iterator> range =
+									_index.equal_range( CacheKey(stream.getPath(), stream.getModTime()) );
+	
+	for(CacheIndex::const_iterator i = range.first; i != range.second; ++i)
 	{
-		if( MatchDateTime(stream.getModTime(), (*i)->getModTime()) &&
-			stream.getPath() == (*i)->getPath() )
+		const CacheList::iterator cache = i->second;
+	
+		if( MatchDateTime(stream.getModTime(), (*cache)->getModTime()) &&
+			stream.getPath() == (*cache)->getPath() )
 		{
-			return *i;
+			_pool.splice(_pool.begin(), _pool, cache); // now the most recently used
+			
+			return *cache;
 		}
 	}
 	
@@ -536,28 +721,22 @@ OpenEXR_CachePool::findCache(const IStreamPlatform &stream) const
 
 
 OpenEXR_ChannelCache *
-OpenEXR_CachePool::addCache(HybridInputFile &in, const IStreamPlatform &stream, const AEIO_InterruptFuncs *inter)
+OpenEXR_CachePool::addCache(HybridInputFile &in, const IStreamPlatform &stream)
 {
-	_pool.sort(compare_age);
-	
-	while(_pool.size() && _pool.size() >= _max_caches)
-	{
-		delete _pool.front();
-		
-		_pool.pop_front();
-	}
+	trimPool(_max_caches - 1, _max_bytes);
 	
 	if(_max_caches > 0)
 	{
 		try
 		{
-			OpenEXR_ChannelCache *new_cache = new OpenEXR_ChannelCache(_pica_basicP, inter, in, stream);
+			OpenEXR_ChannelCache *new_cache = new OpenEXR_ChannelCache(_pica_basicP, *this, in, stream);
+			
+			_pool.push_front(new_cache);
 			
-			_pool.push_back(new_cache);
+			_index.insert( CacheIndex::value_type(CacheKey(new_cache->getPath(), new_cache->getModTime()), _pool.begin()) );
 			
 			return new_cache;
 		}
-		catch(CancelExc) { throw; }
 		catch(...) {}
 	}
 	
@@ -568,23 +747,123 @@ OpenEXR_CachePool::addCache(HybridInputFile &in, const IStreamPlatform &stream,
 bool
 OpenEXR_CachePool::deleteStaleCaches(int timeout)
 {
-	if(_pool.size() > 0)
+	if(_pool.size() > 0 && _pool.back()->cacheIsStale(timeout))
 	{
-		const int old_size = _pool.size();
+		deleteOldest(); // just going to delete one cache per cycle, the oldest one
+		
+		return true;
+	}
+	
+	return false;
+}
+
+
+bool
+OpenEXR_CachePool::makeRoom(const OpenEXR_ChannelCache *cache, size_t bytes)
+{
+	if(_max_bytes == 0)
+		return true;
+	
+	if(cache->cacheSize() + bytes > _max_bytes)
+		return false;
+	
+	// can't use trimPool() here because a byte limit of 0 means no limit there,
+	// but we might need to get rid of everything but this cache
+	size_t pool_size = poolSize();
+	
+	CacheList::iterator i = _pool.end();
 	
-		_pool.sort(compare_age);
+	while(i != _pool.begin() && pool_size + bytes > _max_bytes)
+	{
+		--i;
 		
-		if( _pool.front()->cacheIsStale(timeout) )
+		if(*i != cache)
 		{
-			delete _pool.front(); // just going to delete one cache per cycle, the oldest one
+			pool_size -= (*i)->cacheSize();
+			
+			CacheList::iterator next = i;
+			
+			++next;
 			
-			_pool.pop_front();
+			deleteCache(i);
+			
+			i = next;
 		}
+	}
+	
+	return true;
+}
+
+
+void
+OpenEXR_CachePool::trimPool(int max_caches, size_t max_bytes, const OpenEXR_ChannelCache *keep)
+{
+	size_t pool_size = poolSize();
+	
+	// oldest caches are at the back
+	CacheList::iterator i = _pool.end();
+	
+	while(i != _pool.begin() &&
+			((int)_pool.size() > max(max_caches, 0) || (max_bytes > 0 && pool_size > max_bytes)) )
+	{
+		--i;
 		
-		return (_pool.size() < old_size); // did something actually get deleted?
+		if(*i != keep)
+		{
+			pool_size -= (*i)->cacheSize();
+			
+			CacheList::iterator next = i;
+			
+			++next;
+			
+			deleteCache(i);
+			
+			i = next;
+		}
 	}
+}
+
+
+void
+OpenEXR_CachePool::deleteOldest()
+{
+	assert(_pool.size() > 0);
 	
-	return false;
+	deleteCache(--_pool.end());
+}
+
+
+void
+OpenEXR_CachePool::deleteCache(CacheList::iterator cache)
+{
+	const pair<CacheIndex::iterator, CacheIndex::iterator> range =
+									_index.equal_range( CacheKey((*cache)->getPath(), (*cache)->getModTime()) );
+	
+	for(CacheIndex::iterator i = range.first; i != range.second; ++i)
+	{
+		if(i->second == cache)
+		{
+			_index.erase(i);
+			
+			break;
+		}
+	}
+	
+	delete *cache;
+	
+	_pool.erase(cache);
+}
+
+
+size_t
+OpenEXR_CachePool::poolSize() const
+{
+	size_t pool_size = 0;
+	
+	for(CacheList::const_iterator i = _pool.begin(); i != _pool.end(); ++i)
+		pool_size += (*i)->cacheSize();
+	
+	return pool_size;
 }
 
 
@@ -627,3 +906,22 @@ int ScanlineBlockSize(const HybridInputFile &in)
 	return scanline_block_size;
 }
 
+
+bool SingleScanlineChunks(const HybridInputFile &in)
+{
+	// Uncompressed and RLE files store every scanline in its own chunk
+	// and are cheap to decode, so when we only need every Nth line
+	// it's worth reading them one at a time and skipping the rest.
+	for(int n=0; n < in.parts(); n++)
+	{
+		const Header &head = in.header(n);
+		
+		if( head.hasTileDescription() ||
+			(head.compression() != NO_COMPRESSION && head.compression() != RLE_COMPRESSION) )
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
@@ -15,7 +15,11 @@
 
 #include "fnord_SuiteHandler.h"
 
+#include <IlmThreadMutex.h>
+
 #include <list>
+#include <map>
+#include <vector>
 #include <time.h>
 
 
@@ -33,14 +37,22 @@ class CancelExc : public std::exception
 };
 
 
+class OpenEXR_CachePool;
+
 class OpenEXR_ChannelCache
 {
   public:
-	OpenEXR_ChannelCache(const SPBasicSuite *pica_basicP, const AEIO_InterruptFuncs *inter,
+	OpenEXR_ChannelCache(const SPBasicSuite *pica_basicP, OpenEXR_CachePool &pool,
 							Imf::HybridInputFile &in, const IStreamPlatform &stream);
 	~OpenEXR_ChannelCache();
 	
-	void fillFrameBuffer(const Imf::FrameBuffer &framebuffer, const Imath::Box2i &dw);
+	// Channels get decoded from the file (and kept) the first time they're asked for,
+	// so this might change the file's frame buffer.  Returns false if they couldn't be,
+	// then it's up to the caller to read the file.
+	bool fillFrameBuffer(Imf::HybridInputFile &in, const Imf::FrameBuffer &framebuffer, const Imath::Box2i &dw,
+							const AEIO_InterruptFuncs *inter) { return fillFrameBuffer(in, framebuffer, dw, dw, inter); }
+	bool fillFrameBuffer(Imf::HybridInputFile &in, const Imf::FrameBuffer &framebuffer, const Imath::Box2i &dw,
+							const Imath::Box2i &region, const AEIO_InterruptFuncs *inter);
 	
 	const PathString & getPath() const { return _path; }
 	DateTime getModTime() const { return _modtime; }
@@ -48,9 +60,17 @@ class OpenEXR_ChannelCache
 	double cacheAge() const;
 	bool cacheIsStale(int timeout) const;
 	
+	size_t cacheSize() const { return _bytes; }
+	
+  private:
+	bool loadChannels(Imf::HybridInputFile &in, const Imf::FrameBuffer &framebuffer, const AEIO_InterruptFuncs *inter);
+	void deleteChannels(const std::vector<std::string> &names);
+	
   private:
 	AEGP_SuiteHandler suites;
 	
+	OpenEXR_CachePool &_pool;
+	
 	int _width;
 	int _height;
 	
@@ -63,6 +83,7 @@ class OpenEXR_ChannelCache
 	
 	typedef std::map<std::string, ChannelCache> ChannelMap;
 	ChannelMap _cache;
+	size_t _bytes;
 	
 	PathString _path;
 	DateTime _modtime;
@@ -72,28 +93,47 @@ class OpenEXR_ChannelCache
 };
 
 
+// Caches are kept in least-recently-used order and limited by count and by
+// the total size of their channels.  Caches get bigger as channels are loaded,
+// so they ask the pool for room first and the pool deletes the oldest ones.
 class OpenEXR_CachePool
 {
   public:
 	OpenEXR_CachePool();
 	~OpenEXR_CachePool();
 	
-	void configurePool(int max_caches, const SPBasicSuite *pica_basicP=NULL);
+	void configurePool(int max_caches, size_t max_bytes, const SPBasicSuite *pica_basicP=NULL);
 	
-	OpenEXR_ChannelCache *findCache(const IStreamPlatform &stream) const;
+	OpenEXR_ChannelCache *findCache(const IStreamPlatform &stream); // also marks it as recently used
 	
-	OpenEXR_ChannelCache *addCache(Imf::HybridInputFile &in, const IStreamPlatform &stream, const AEIO_InterruptFuncs *inter);
+	OpenEXR_ChannelCache *addCache(Imf::HybridInputFile &in, const IStreamPlatform &stream);
 	
 	bool deleteStaleCaches(int timeout); // returns true if something was deleted
 	
+	// returns false if the cache can't grow by this much even with all the others gone
+	bool makeRoom(const OpenEXR_ChannelCache *cache, size_t bytes);
+	
+  private:
+	typedef std::list<OpenEXR_ChannelCache *> CacheList;
+	typedef std::multimap<size_t, CacheList::iterator> CacheIndex;
+	
+	void trimPool(int max_caches, size_t max_bytes, const OpenEXR_ChannelCache *keep=NULL);
+	void deleteOldest();
+	void deleteCache(CacheList::iterator cache);
+	size_t poolSize() const;
+	
   private:
 	int _max_caches;
+	size_t _max_bytes;
 	const SPBasicSuite *_pica_basicP;
-	std::list<OpenEXR_ChannelCache *> _pool;
+	CacheList _pool; // most recently used at the front
+	CacheIndex _index; // hash of path and mod time
 };
 
 
 int ScanlineBlockSize(const Imf::HybridInputFile &in);
 
+bool SingleScanlineChunks(const Imf::HybridInputFile &in);
+
 
 #endif // OPENEXR_CHANNEL_CACHE_H
\ No newline at end of file
@@ -0,0 +1,641 @@
+//
+//	OpenEXR file importer/exporter for After Effects (AEIO)
+// 
+//	by Brendan Bolles <brendan@fnordware.com>
+//
+//	see OpenEXR.cpp for more information
+//
+
+#include "OpenEXR_FileCache.h"
+
+#include <IexBaseExc.h>
+
+#include <IlmThread.h>
+#include <IlmThreadMutex.h>
+
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+
+
+using namespace Imf;
+using namespace Iex;
+using namespace IlmThread;
+using namespace std;
+
+
+OpenEXR_FileCache::OpenEXR_FileCache() :
+	_max_files(0),
+	_hits(0),
+	_misses(0)
+{
+
+}
+
+
+OpenEXR_FileCache::~OpenEXR_FileCache()
+{
+	configureCache(0);
+}
+
+
+static void
+DeleteOpenFile(OpenEXR_FileCache::OpenFile *open_file)
+{
+	delete open_file->file;
+	delete open_file->source;
+	delete open_file->stream;
+	delete open_file;
+}
+
+
+static bool
+compare_access(const OpenEXR_FileCache::OpenFile *first, const OpenEXR_FileCache::OpenFile *second)
+{
+	return first->last_access < second->last_access;
+}
+
+
+void
+OpenEXR_FileCache::trimCache(size_t max_files)
+{
+	// only files nobody is using can go, oldest first
+	_files.sort(compare_access);
+	
+	list<OpenFile *>::iterator i = _files.begin();
+	
+	while(_files.size() > max_files && i != _files.end())
+	{
+		if( !(*i)->in_use )
+		{
+			DeleteOpenFile(*i);
+			
+			i = _files.erase(i);
+		}
+		else
+			++i;
+	}
+}
+
+
+void
+OpenEXR_FileCache::configureCache(int max_files)
+{
+	Lock lock(_mutex);
+	
+	_max_files = max_files;
+	
+	trimCache( max(_max_files, 0) );
+}
+
+
+OpenEXR_FileCache::OpenFile *
+OpenEXR_FileCache::checkOut(const A_PathType *file_pathZ, const SPBasicSuite *pica_basicP)
+{
+	// the file's stats are enough to know if we have it already
+	Int64 file_size = 0;
+	DateTime modtime;
+	
+	if( GetFileStats(file_pathZ, file_size, modtime) )
+	{
+		const PathString path(file_pathZ);
+		
+		Lock lock(_mutex);
+		
+		for(list<OpenFile *>::iterator i = _files.begin(); i != _files.end(); ++i)
+		{
+			OpenFile *open_file = *i;
+			
+			if( !open_file->in_use && !open_file->forgotten &&
+				file_size == open_file->stream->size() &&
+				MatchDateTime(modtime, open_file->stream->getModTime()) &&
+				path == open_file->stream->getPath() )
+			{
+				open_file->in_use = true;
+				open_file->last_access = time(NULL);
+				
+				_hits++;
+				
+				return open_file;
+			}
+		}
+	}
+	
+	
+	IStreamPlatform *stream = new IStreamPlatform(file_pathZ, pica_basicP);
+	
+	HybridInputFile *file = NULL;
+	CursorStreamSource *source = NULL;
+	
+	try
+	{
+		file = new HybridInputFile(*stream);
+		
+		source = new CursorStreamSource(*stream);
+	}
+	catch(...)
+	{
+		delete file;
+		delete stream;
+		
+		throw;
+	}
+	
+	OpenFile *open_file = new OpenFile;
+	
+	open_file->stream = stream;
+	open_file->file = file;
+	open_file->source = source;
+	open_file->in_use = true;
+	open_file->forgotten = false;
+	open_file->last_access = time(NULL);
+	
+	Lock lock(_mutex);
+	
+	_files.push_back(open_file);
+	
+	_misses++;
+	
+	return open_file;
+}
+
+
+void
+OpenEXR_FileCache::checkIn(OpenFile *open_file)
+{
+	// The memory map is only kept during the call that checked the file out.
+	// The extra parallel readers go back to plain reads along with the stream.
+	open_file->stream->unMemoryMap();
+	
+	
+	Lock lock(_mutex);
+	
+	open_file->in_use = false;
+	open_file->last_access = time(NULL);
+	
+	if(open_file->forgotten)
+	{
+		_files.remove(open_file);
+		
+		DeleteOpenFile(open_file);
+	}
+	
+	trimCache( max(_max_files, 0) );
+}
+
+
+bool
+OpenEXR_FileCache::deleteStaleFiles(int timeout)
+{
+	Lock lock(_mutex);
+	
+	const size_t old_size = _files.size();
+	
+	const time_t now = time(NULL);
+	
+	list<OpenFile *>::iterator i = _files.begin();
+	
+	while(i != _files.end())
+	{
+		if( !(*i)->in_use && difftime(now, (*i)->last_access) > timeout )
+		{
+			DeleteOpenFile(*i);
+			
+			i = _files.erase(i);
+		}
+		else
+			++i;
+	}
+	
+	return (_files.size() < old_size);
+}
+
+
+void
+OpenEXR_FileCache::forgetFile(const A_PathType *file_pathZ)
+{
+	const PathString path(file_pathZ);
+	
+	{
+		Lock lock(_mutex);
+		
+		list<OpenFile *>::iterator i = _files.begin();
+		
+		while(i != _files.end())
+		{
+			OpenFile *open_file = *i;
+			
+			if(open_file->stream->getPath() == path)
+			{
+				if(open_file->in_use)
+				{
+					open_file->forgotten = true; // checkIn() will delete it
+					
+					++i;
+				}
+				else
+				{
+					DeleteOpenFile(open_file);
+					
+					i = _files.erase(i);
+				}
+			}
+			else
+				++i;
+		}
+	}
+	
+	// and any mappings of it that nobody is using
+	DeleteFileMaps(path);
+}
+
+
+unsigned int
+OpenEXR_FileCache::hits() const
+{
+	Lock lock(_mutex);
+	
+	return _hits;
+}
+
+
+unsigned int
+OpenEXR_FileCache::misses() const
+{
+	Lock lock(_mutex);
+	
+	return _misses;
+}
+
+
+// sits with the frames, the entries are in the order of this struct and native byte order
+static const char HeaderIndexName[] = ".exrindex";
+
+typedef struct HeaderIndexPrefix {
+	char			magic[8];
+	unsigned int	path_char_size; // a different platform's index won't match
+	unsigned int	date_time_size;
+	unsigned int	entries;
+} HeaderIndexPrefix;
+
+static const char HeaderIndexMagic[8] = { 'e', 'x', 'r', 'i', 'n', 'd', 'x', '1' };
+
+static const int HeaderIndexMaxDirectories = 64;
+
+static const Int64 HeaderIndexMaxHeaderSize = 16 * 1024 * 1024;
+
+
+OpenEXR_HeaderIndex::OpenEXR_HeaderIndex() :
+	_enabled(false)
+{
+
+}
+
+
+OpenEXR_HeaderIndex::~OpenEXR_HeaderIndex()
+{
+	configure(false);
+}
+
+
+void
+OpenEXR_HeaderIndex::configure(bool enabled)
+{
+	saveIndexes();
+	
+	Lock lock(_mutex);
+	
+	_enabled = enabled;
+	
+	if(!_enabled)
+	{
+		_indexes.clear();
+		_unwritable.clear();
+	}
+}
+
+
+template <typename T>
+static void
+ReadIndexValue(const char *&p, const char *end, T &value)
+{
+	if(sizeof(T) > (size_t)(end - p))
+		throw IoExc("Truncated header index.");
+	
+	memcpy(&value, p, sizeof(T));
+	
+	p += sizeof(T);
+}
+
+
+template <typename T>
+static void
+ReadIndexArray(const char *&p, const char *end, vector<T> &array)
+{
+	unsigned int count = 0;
+	
+	ReadIndexValue(p, end, count);
+	
+	if(count > (size_t)(end - p) / sizeof(T))
+		throw IoExc("Truncated header index.");
+	
+	array.resize(count);
+	
+	if(count > 0)
+		memcpy(&array[0], p, count * sizeof(T));
+	
+	p += count * sizeof(T);
+}
+
+
+template <typename T>
+static void
+WriteIndexValue(vector<char> &out, const T &value)
+{
+	const char *c = (const char *)&value;
+	
+	out.insert(out.end(), c, c + sizeof(T));
+}
+
+
+template <typename T>
+static void
+WriteIndexArray(vector<char> &out, const vector<T> &array)
+{
+	WriteIndexValue(out, (unsigned int)array.size());
+	
+	if( !array.empty() )
+	{
+		const char *c = (const char *)&array[0];
+		
+		out.insert(out.end(), c, c + (array.size() * sizeof(T)));
+	}
+}
+
+
+// "dir/name" -> "dir/", "name"
+static bool
+SplitFilePath(const A_PathType *path, vector<A_PathType> &dir, vector<A_PathType> &name)
+{
+	const int len = PathString::StrLen(path);
+	
+	int slash = len - 1;
+	
+	while(slash >= 0 && path[slash] != '/' && path[slash] != '\\')
+		slash--;
+	
+	if(slash < 0 || slash == len - 1)
+		return false;
+	
+	dir.assign(path, path + slash + 1);
+	name.assign(path + slash + 1, path + len);
+	
+	return true;
+}
+
+
+static vector<A_PathType>
+HeaderIndexPath(const vector<A_PathType> &dir)
+{
+	vector<A_PathType> path(dir);
+	
+	for(const char *c = HeaderIndexName; *c != '\0'; c++)
+		path.push_back(*c);
+	
+	path.push_back('\0');
+	
+	return path;
+}
+
+
+void
+OpenEXR_HeaderIndex::loadIndex(const PathChars &dir, DirectoryIndex &index)
+{
+	const PathChars index_path = HeaderIndexPath(dir);
+	
+	Int64 size = 0;
+	DateTime modtime;
+	
+	if( !GetFileStats(&index_path[0], size, modtime) || size < (Int64)sizeof(HeaderIndexPrefix) )
+		return;
+	
+	try
+	{
+		IStreamPlatform stream(&index_path[0]);
+		
+		vector<char> data(stream.size());
+		
+		if( !stream.readAt(&data[0], data.size(), 0) )
+			return;
+		
+		const char *p = &data[0];
+		const char *end = p + data.size();
+		
+		HeaderIndexPrefix prefix;
+		
+		ReadIndexValue(p, end, prefix);
+		
+		if(memcmp(prefix.magic, HeaderIndexMagic, sizeof(HeaderIndexMagic)) != 0 ||
+			prefix.path_char_size != sizeof(A_PathType) ||
+			prefix.date_time_size != sizeof(DateTime))
+		{
+			return;
+		}
+		
+		for(unsigned int i=0; i < prefix.entries; i++)
+		{
+			PathChars name;
+			IndexEntry entry;
+			
+			ReadIndexArray(p, end, name);
+			ReadIndexValue(p, end, entry.size);
+			ReadIndexValue(p, end, entry.modtime);
+			ReadIndexArray(p, end, entry.headers);
+			
+			if( !entry.headers.empty() )
+				index.entries[name] = entry;
+		}
+	}
+	catch(...)
+	{
+		// a bad index is the same as none, it'll get written over
+		index.entries.clear();
+	}
+}
+
+
+bool
+OpenEXR_HeaderIndex::saveIndex(const PathChars &dir, const DirectoryIndex &index)
+{
+	vector<char> data;
+	
+	HeaderIndexPrefix prefix;
+	
+	memcpy(prefix.magic, HeaderIndexMagic, sizeof(HeaderIndexMagic));
+	prefix.path_char_size = sizeof(A_PathType);
+	prefix.date_time_size = sizeof(DateTime);
+	prefix.entries = index.entries.size();
+	
+	WriteIndexValue(data, prefix);
+	
+	for(map<PathChars, IndexEntry>::const_iterator i = index.entries.begin(); i != index.entries.end(); ++i)
+	{
+		WriteIndexArray(data, i->first);
+		WriteIndexValue(data, i->second.size);
+		WriteIndexValue(data, i->second.modtime);
+		WriteIndexArray(data, i->second.headers);
+	}
+	
+	try
+	{
+		const PathChars index_path = HeaderIndexPath(dir);
+		
+		OStreamPlatform stream(&index_path[0]);
+		
+		stream.write(&data[0], data.size());
+		
+		stream.finish();
+	}
+	catch(...) { return false; } // can't write in that directory, so no index
+	
+	return true;
+}
+
+
+// call with _mutex locked
+void
+OpenEXR_HeaderIndex::saveChanged(const PathChars &dir, DirectoryIndex &index)
+{
+	if(index.changed && _unwritable.find(dir) == _unwritable.end())
+	{
+		if( !saveIndex(dir, index) )
+			_unwritable.insert(dir);
+	}
+	
+	index.changed = false;
+}
+
+
+void
+OpenEXR_HeaderIndex::saveIndexes()
+{
+	Lock lock(_mutex);
+	
+	for(IndexMap::iterator i = _indexes.begin(); i != _indexes.end(); ++i)
+	{
+		saveChanged(i->first, i->second);
+	}
+}
+
+
+// call with _mutex locked
+OpenEXR_HeaderIndex::DirectoryIndex &
+OpenEXR_HeaderIndex::directoryIndex(const PathChars &dir)
+{
+	IndexMap::iterator index = _indexes.find(dir);
+	
+	if(index == _indexes.end())
+	{
+		if(_indexes.size() >= HeaderIndexMaxDirectories)
+		{
+			for(IndexMap::iterator i = _indexes.begin(); i != _indexes.end(); ++i)
+			{
+				saveChanged(i->first, i->second);
+			}
+			
+			_indexes.clear();
+		}
+		
+		index = _indexes.insert( IndexMap::value_type(dir, DirectoryIndex()) ).first;
+		
+		loadIndex(dir, index->second);
+	}
+	
+	return index->second;
+}
+
+
+bool
+OpenEXR_HeaderIndex::findHeaders(const A_PathType *file_pathZ, vector<char> &headers)
+{
+	PathChars dir, name;
+	
+	Int64 size = 0;
+	DateTime modtime;
+	
+	bool use_index = false;
+	
+	{
+		Lock lock(_mutex);
+		
+		use_index = _enabled;
+	}
+	
+	use_index = (use_index &&
+					SplitFilePath(file_pathZ, dir, name) &&
+					GetFileStats(file_pathZ, size, modtime));
+	
+	if(!use_index)
+		return false;
+	
+	
+	Lock lock(_mutex);
+	
+	const DirectoryIndex &index = directoryIndex(dir);
+	
+	map<PathChars, IndexEntry>::const_iterator entry = index.entries.find(name);
+	
+	if(entry != index.entries.end() &&
+		entry->second.size == size &&
+		MatchDateTime(entry->second.modtime, modtime))
+	{
+		headers = entry->second.headers;
+		
+		return true;
+	}
+	
+	return false;
+}
+
+
+void
+OpenEXR_HeaderIndex::addHeaders(IStreamPlatform &stream)
+{
+	{
+		Lock lock(_mutex);
+		
+		if(!_enabled)
+			return;
+	}
+	
+	PathChars dir, name;
+	
+	if( !SplitFilePath(stream.getPath().string(), dir, name) )
+		return;
+	
+	// HybridHeaders left the stream where the headers end, so the bytes
+	// for the index come from what was just read instead of another parse
+	const Int64 len = stream.tellg();
+	
+	if(len <= 0 || len > HeaderIndexMaxHeaderSize)
+		return;
+	
+	vector<char> headers(len);
+	
+	if( !stream.readAt(&headers[0], len, 0) )
+		return;
+	
+	
+	Lock lock(_mutex);
+	
+	DirectoryIndex &index = directoryIndex(dir);
+	
+	IndexEntry &entry = index.entries[name];
+	
+	entry.size = stream.size();
+	entry.modtime = stream.getModTime();
+	entry.headers.swap(headers);
+	
+	index.changed = true;
+}
@@ -0,0 +1,154 @@
+//
+//	OpenEXR file importer/exporter for After Effects (AEIO)
+// 
+//	by Brendan Bolles <brendan@fnordware.com>
+//
+//	see OpenEXR.cpp for more information
+//
+
+#ifndef OPENEXR_FILE_CACHE_H
+#define OPENEXR_FILE_CACHE_H
+
+#include "ImfHybridInputFile.h"
+
+#include "OpenEXR_PlatformIO.h"
+
+#include "fnord_SuiteHandler.h"
+
+#include <IlmThreadMutex.h>
+
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <time.h>
+
+
+// HybridInputFile's extra streams for parallel reads, all reading the one open file
+class CursorStreamSource : public Imf::HybridStreamSource
+{
+  public:
+	CursorStreamSource(const IStreamPlatform &stream) : _stream(stream) {}
+	virtual ~CursorStreamSource() {}
+	
+	virtual Imf::IStream * newStream() { return new IStreamPlatformCursor(_stream); }
+	
+  private:
+	const IStreamPlatform &_stream;
+};
+
+
+// Files that have been opened and had their headers and chunk offset tables parsed,
+// so FileInfo, DrawSparseFrame and DrawAuxChannel don't do it all over again.
+class OpenEXR_FileCache
+{
+  public:
+	OpenEXR_FileCache();
+	~OpenEXR_FileCache();
+	
+	typedef struct OpenFile {
+		IStreamPlatform			*stream;
+		Imf::HybridInputFile	*file;
+		CursorStreamSource		*source; // extra parallel readers stay with the file
+		bool					in_use;
+		bool					forgotten; // goes away when checked in
+		time_t					last_access;
+	} OpenFile;
+	
+	void configureCache(int max_files);
+	
+	OpenFile *checkOut(const A_PathType *file_pathZ, const SPBasicSuite *pica_basicP);
+	void checkIn(OpenFile *open_file);
+	
+	bool deleteStaleFiles(int timeout); // returns true if something was deleted
+	
+	// Before writing over a file.  Windows won't let us while we have it open.
+	void forgetFile(const A_PathType *file_pathZ);
+	
+	// how many checkOut() calls found the file already open, and how many had to open it
+	unsigned int hits() const;
+	unsigned int misses() const;
+	
+  private:
+	void trimCache(size_t max_files);
+	
+  private:
+	int _max_files;
+	std::list<OpenFile *> _files;
+	unsigned int _hits;
+	unsigned int _misses;
+	mutable IlmThread::Mutex _mutex;
+};
+
+
+// a file checked out of the cache for as long as this object is around
+class OpenEXR_CachedFile
+{
+  public:
+	OpenEXR_CachedFile(OpenEXR_FileCache &cache, const A_PathType *file_pathZ, const SPBasicSuite *pica_basicP) :
+		_cache(cache), _open_file(cache.checkOut(file_pathZ, pica_basicP)) {}
+	~OpenEXR_CachedFile() { _cache.checkIn(_open_file); }
+	
+	IStreamPlatform & stream() const { return *_open_file->stream; }
+	Imf::HybridInputFile & file() const { return *_open_file->file; }
+	Imf::HybridStreamSource & streamSource() const { return *_open_file->source; }
+	
+  private:
+	OpenEXR_FileCache &_cache;
+	OpenEXR_FileCache::OpenFile *_open_file;
+};
+
+
+// The headers of the frames in a directory, kept together in a sidecar file there,
+// so getting the file info for a long sequence (like when a project opens) doesn't
+// open every frame.  Entries are checked against each file's size and mod time.
+class OpenEXR_HeaderIndex
+{
+  public:
+	OpenEXR_HeaderIndex();
+	~OpenEXR_HeaderIndex();
+	
+	void configure(bool enabled);
+	
+	// The bytes from the start of the file through the last header, for HybridHeaders.
+	// Returns false when the index is off or doesn't have this version of the file,
+	// then read the headers from the file and pass its stream to addHeaders().
+	bool findHeaders(const A_PathType *file_pathZ, std::vector<char> &headers);
+	
+	// after HybridHeaders has read the headers from this stream, so it's at their end
+	void addHeaders(IStreamPlatform &stream);
+	
+	void saveIndexes(); // writes the sidecars that changed
+	
+  private:
+	typedef std::vector<A_PathType> PathChars;
+	
+	typedef struct IndexEntry {
+		Imf::Int64			size;
+		DateTime			modtime;
+		std::vector<char>	headers;
+	} IndexEntry;
+	
+	typedef struct DirectoryIndex {
+		std::map<PathChars, IndexEntry>	entries; // by file name
+		bool							changed;
+		
+		DirectoryIndex() : changed(false) {}
+	} DirectoryIndex;
+	
+	typedef std::map<PathChars, DirectoryIndex> IndexMap; // by directory
+	
+	DirectoryIndex & directoryIndex(const PathChars &dir);
+	void loadIndex(const PathChars &dir, DirectoryIndex &index);
+	bool saveIndex(const PathChars &dir, const DirectoryIndex &index);
+	void saveChanged(const PathChars &dir, DirectoryIndex &index);
+	
+  private:
+	bool _enabled;
+	IndexMap _indexes;
+	std::set<PathChars> _unwritable; // a save failed there, so we won't keep trying
+	IlmThread::Mutex _mutex;
+};
+
+
+#endif // OPENEXR_FILE_CACHE_H
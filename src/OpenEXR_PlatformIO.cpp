@@ -15,109 +15,261 @@
 #include <time.h>
 #include <assert.h>
 
+#include <IlmThread.h>
+#include <IlmThreadMutex.h>
+#include <IlmThreadSemaphore.h>
+
+#include <list>
+#include <memory>
+#include <algorithm>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
+
+#if !defined(__APPLE__) && !defined(WIN32)
+#include <sys/uio.h>
+#include <errno.h>
+#endif
+
+#include <string.h>
+#include <stdio.h>
+
 using namespace Imf;
 using namespace Iex;
 
 
-extern AEGP_PluginID	S_mem_id;
+// The "Memory Map" pref keeps mappings of recently used files around, so the next
+// stream to open one of them (like another layer using the same file) gets it for free.
+// The pages themselves are the OS's file cache, shared with everyone else.
+struct FileMap {
+	void		*map;
+	Int64		size;
+	PathString	path;
+	DateTime	date_time;
+	time_t		last_access;
+	int			users;
+};
 
-static AEGP_MemHandle	file_cacheH = NULL;
-static PathString		file_cache_path;
-static DateTime			file_cache_date_time;
-static Int64			file_cache_size = 0;
-static time_t			file_cache_last_access;
+static std::list<FileMap *>	file_maps; // most recently used at the front
+static Int64				file_maps_max_bytes = 0;
+static IlmThread::Mutex		file_maps_mutex;
 
 
-static bool
-MatchCacheDateTime(DateTime date_time)
+bool
+MatchDateTime(const DateTime &d1, const DateTime &d2)
 {
 #ifdef __APPLE__
-	return (date_time.fraction == file_cache_date_time.fraction &&
-			date_time.lowSeconds == file_cache_date_time.lowSeconds &&
-			date_time.highSeconds == file_cache_date_time.highSeconds);
+	return (d1.fraction == d2.fraction &&
+			d1.lowSeconds == d2.lowSeconds &&
+			d1.highSeconds == d2.highSeconds);
+#elif defined(WIN32)
+	return (d1.dwHighDateTime == d2.dwHighDateTime &&
+			d1.dwLowDateTime == d2.dwLowDateTime);
 #else
-	return (date_time.dwHighDateTime == file_cache_date_time.dwHighDateTime &&
-			date_time.dwLowDateTime == file_cache_date_time.dwLowDateTime);
+	return (d1.tv_sec == d2.tv_sec &&
+			d1.tv_nsec == d2.tv_nsec);
 #endif
 }
 
 
-static void *
-LockFileCache(const SPBasicSuite *pica_basicP)
+static void
+UnmapFile(void *map, Int64 size)
 {
-	A_Err err = A_Err_NONE;
+#ifdef WIN32
+	BOOL result = UnmapViewOfFile(map);
 	
-	if(pica_basicP == NULL)
-		throw LogicExc("pica_basicP is NULL");
+	assert(result);
+#else
+	int result = munmap(map, size);
 	
-	AEGP_SuiteHandler suites(pica_basicP);
+	assert(result == 0);
+#endif
+}
 
-	void *cache = NULL;
+
+// tell the OS we're about to read this part of the mapping
+static void
+PrefetchMap(void *map, Int64 map_size, Int64 pos, Int64 size)
+{
+#ifndef WIN32
+	// madvise wants a page-aligned address
+	static const Int64 page_size = sysconf(_SC_PAGESIZE);
 	
-	if(file_cacheH)
-	{
-		err = suites.MemorySuite()->AEGP_LockMemHandle(file_cacheH, (void**)&cache);
-		
-		file_cache_last_access = time(NULL);
-	}
+	const Int64 start = pos - (pos % page_size);
+	const Int64 end = std::min(pos + size, map_size);
 	
-	return cache;
+	if(end > start)
+		madvise((char *)map + start, end - start, MADV_WILLNEED);
+#endif
+	// Windows does its own read-ahead on mapped files
 }
 
 
+// call with file_maps_mutex locked
 static void
-UnlockFileCache(const SPBasicSuite *pica_basicP)
+TrimFileMaps(Int64 max_bytes, int timeout=-1)
 {
-	A_Err err = A_Err_NONE;
+	Int64 total_bytes = 0;
 	
-	if(pica_basicP == NULL)
-		throw LogicExc("pica_basicP is NULL");
+	for(std::list<FileMap *>::const_iterator i = file_maps.begin(); i != file_maps.end(); ++i)
+		total_bytes += (*i)->size;
 	
-	AEGP_SuiteHandler suites(pica_basicP);
-
-	if(file_cacheH)
-		err = suites.MemorySuite()->AEGP_UnlockMemHandle(file_cacheH);
+	// oldest at the back, and we only delete the ones nobody is reading
+	std::list<FileMap *>::iterator i = file_maps.end();
+	
+	while(i != file_maps.begin())
+	{
+		--i;
+		
+		FileMap *file_map = *i;
+		
+		const bool over_limit = (max_bytes >= 0 && total_bytes > max_bytes);
+		const bool stale = (timeout >= 0 && difftime(time(NULL), file_map->last_access) > timeout);
+		
+		if(file_map->users == 0 && (over_limit || stale))
+		{
+			UnmapFile(file_map->map, file_map->size);
+			
+			total_bytes -= file_map->size;
+			
+			delete file_map;
+			
+			i = file_maps.erase(i);
+		}
+	}
 }
 
 
-void
-DeleteFileCache(const SPBasicSuite *pica_basicP, int timeout)
+static FileMap *
+AcquireFileMap(const PathString &path, const DateTime &date_time)
 {
-	if(pica_basicP == NULL)
-		throw LogicExc("pica_basicP is NULL");
+	IlmThread::Lock lock(file_maps_mutex);
 	
-	if(file_cacheH && (timeout == 0 || (difftime(time(NULL), file_cache_last_access) > timeout)) )
+	for(std::list<FileMap *>::iterator i = file_maps.begin(); i != file_maps.end(); ++i)
 	{
-		AEGP_SuiteHandler suites(pica_basicP);
+		FileMap *file_map = *i;
+		
+		if(MatchDateTime(date_time, file_map->date_time) && path == file_map->path)
+		{
+			file_map->users++;
+			file_map->last_access = time(NULL);
+			
+			file_maps.splice(file_maps.begin(), file_maps, i);
+			
+			return file_map;
+		}
+	}
+	
+	return NULL;
+}
 
-		A_Err err = suites.MemorySuite()->AEGP_FreeMemHandle(file_cacheH);
+
+static FileMap *
+AddFileMap(void *map, Int64 size, const PathString &path, const DateTime &date_time)
+{
+	IlmThread::Lock lock(file_maps_mutex);
+	
+	for(std::list<FileMap *>::iterator i = file_maps.begin(); i != file_maps.end(); ++i)
+	{
+		FileMap *file_map = *i;
 		
-		file_cacheH = NULL;
-		file_cache_path = "";
-		file_cache_size = 0;
+		if(MatchDateTime(date_time, file_map->date_time) && path == file_map->path)
+		{
+			// another stream mapped the same file while we were, use theirs
+			UnmapFile(map, size);
+			
+			file_map->users++;
+			file_map->last_access = time(NULL);
+			
+			file_maps.splice(file_maps.begin(), file_maps, i);
+			
+			return file_map;
+		}
 	}
+	
+	FileMap *file_map = new FileMap;
+	
+	file_map->map = map;
+	file_map->size = size;
+	file_map->path = path;
+	file_map->date_time = date_time;
+	file_map->last_access = time(NULL);
+	file_map->users = 1;
+	
+	file_maps.push_front(file_map);
+	
+	TrimFileMaps(file_maps_max_bytes);
+	
+	return file_map;
+}
+
+
+static void
+ReleaseFileMap(FileMap *file_map)
+{
+	IlmThread::Lock lock(file_maps_mutex);
+	
+	assert(file_map->users > 0);
+	
+	file_map->users--;
+	file_map->last_access = time(NULL);
+	
+	// a file bigger than the whole limit goes away as soon as it's not used
+	TrimFileMaps(file_maps_max_bytes);
 }
 
 
-static void *
-NewFileCache(const SPBasicSuite *pica_basicP, AEGP_MemSize size)
+void
+ConfigureFileCache(Int64 max_bytes)
 {
-	A_Err err = A_Err_NONE;
+	IlmThread::Lock lock(file_maps_mutex);
+	
+	file_maps_max_bytes = max_bytes;
 	
-	if(pica_basicP == NULL)
-		throw LogicExc("pica_basicP is NULL");
+	TrimFileMaps(file_maps_max_bytes);
+}
+
+
+void
+DeleteFileCache(int timeout)
+{
+	IlmThread::Lock lock(file_maps_mutex);
 	
-	AEGP_SuiteHandler suites(pica_basicP);
+	if(timeout == 0)
+		TrimFileMaps(0);
+	else
+		TrimFileMaps(-1, timeout);
+}
+
 
-	DeleteFileCache(pica_basicP);
+void
+DeleteFileMaps(const PathString &path)
+{
+	IlmThread::Lock lock(file_maps_mutex);
 	
-	err = suites.MemorySuite()->AEGP_NewMemHandle(S_mem_id, "File Cache", size,
-													AEGP_MemFlag_CLEAR, &file_cacheH);
-													
-	if(file_cacheH)
-		file_cache_size = size;
-																																					
-	return LockFileCache(pica_basicP);
+	std::list<FileMap *>::iterator i = file_maps.begin();
+	
+	while(i != file_maps.end())
+	{
+		FileMap *file_map = *i;
+		
+		if(file_map->users == 0 && file_map->path == path)
+		{
+			UnmapFile(file_map->map, file_map->size);
+			
+			delete file_map;
+			
+			i = file_maps.erase(i);
+		}
+		else
+			++i;
+	}
 }
 
 #pragma mark-
@@ -127,11 +279,18 @@ IStreamPlatform::IStreamPlatform(const char fileName[], const SPBasicSuite *pica
 	IStream(fileName),
 	_pica_basicP(pica_basicP),
 	_vfile(NULL),
+	_vsize(0),
+	_vprefetched(0),
+	_vmap(NULL),
+	_pos(0),
+	_fsize(0),
 	_path(fileName)
 {
 	open_file(fileName);
 	
 	_modtime = file_modtime();
+	
+	_fsize = file_size();
 }
 
 
@@ -139,11 +298,18 @@ IStreamPlatform::IStreamPlatform(const uint16_t fileName[], const SPBasicSuite *
 	IStream("Unicode Path"),
 	_pica_basicP(pica_basicP),
 	_vfile(NULL),
+	_vsize(0),
+	_vprefetched(0),
+	_vmap(NULL),
+	_pos(0),
+	_fsize(0),
 	_path(fileName)
 {
 	open_file(fileName);
 	
 	_modtime = file_modtime();
+	
+	_fsize = file_size();
 }
 
 
@@ -178,21 +344,39 @@ IStreamPlatform::read(char c[/*n*/], int n)
 		return success;
 	}
 	else
-		return read_file(c, n);
+	{
+		const bool success = _reader.read(*this, c, n, _pos);
+		
+		if(success)
+			_pos += n;
+		
+		return success;
+	}
 }
 
+
+static const Int64 PrefetchWindow = 8 * 1024 * 1024;
+
+
 char *
 IStreamPlatform::readMemoryMapped(int n)
 {
-	if( !isMemoryMapped() )
-		throw LogicExc("readMemoryMapped() called for non memory-mapped file.");
+	char *ptr = mappedAt(_pos, n);
 	
-	if(n > (_vsize - _voffset))
-		throw IoExc("Trying to read past the end of a memory-mapped file.");
+	// keep the OS reading a bit ahead of us
+	if(_pos > _vprefetched || _pos + PrefetchWindow < _vprefetched)
+		_vprefetched = _pos; // must have seeked
 	
-	char *ptr = ((char *)_vfile + _voffset);
+	if(_pos + n + (PrefetchWindow / 2) > _vprefetched)
+	{
+		const Int64 prefetch_size = std::max<Int64>(PrefetchWindow, (_pos + n) - _vprefetched);
+		
+		PrefetchMap(_vfile, _vsize, _vprefetched, prefetch_size);
+		
+		_vprefetched += prefetch_size;
+	}
 	
-	_voffset += n;
+	_pos += n;
 	
 	return ptr;
 }
@@ -201,91 +385,143 @@ IStreamPlatform::readMemoryMapped(int n)
 Int64
 IStreamPlatform::tellg()
 {
-	if( isMemoryMapped() )
-	{
-		return _voffset;
-	}
-	else
-		return tellg_file();
+	return _pos;
 }
 
 
 void
 IStreamPlatform::seekg(Int64 pos)
+{
+	if(pos < 0 || (isMemoryMapped() && pos > _vsize))
+		throw IoExc("Trying to seek outside the file.");
+	
+	_pos = pos;
+}
+
+
+bool
+IStreamPlatform::readAt(char c[/*n*/], int n, Int64 pos) const
 {
 	if( isMemoryMapped() )
 	{
-		if(pos > _vsize)
-			throw IoExc("Trying to seek past the end of a memory-mapped file.");
+		if(pos < 0 || n > (_vsize - pos))
+			return false;
+		
+		memcpy(c, (char *)_vfile + pos, n);
 		
-		_voffset = pos;
+		return true;
 	}
 	else
-		seekg_file(pos);
+		return read_file(c, n, pos);
 }
 
 
-void
-IStreamPlatform::memoryMap()
+bool
+IStreamPlatform::readAt(char c[/*n*/], int n, Int64 pos, char *ahead, size_t ahead_n) const
 {
-	assert(_pica_basicP != NULL);
-
-	if(_pica_basicP && !isMemoryMapped() )
+	if(isMemoryMapped() || ahead_n == 0)
+		return (readAt(c, n, pos) && (ahead_n == 0 || readAt(ahead, ahead_n, pos + n)));
+	
+#if !defined(__APPLE__) && !defined(WIN32)
+	// one preadv() for both
+	struct iovec iov[2];
+	
+	iov[0].iov_base = c;
+	iov[0].iov_len = n;
+	iov[1].iov_base = ahead;
+	iov[1].iov_len = ahead_n;
+	
+	struct iovec *v = iov;
+	int iovcnt = 2;
+	
+	while(iovcnt > 0)
 	{
-		if(file_cacheH && MatchCacheDateTime(_modtime) && (_path == file_cache_path))
-		{
-			adopt_cache();
-		}
-		else
+		ssize_t count = preadv(_fd, v, iovcnt, pos);
+		
+		if(count < 0 && errno == EINTR)
+			continue;
+		
+		if(count <= 0)
+			return false;
+		
+		pos += count;
+		
+		while(count > 0)
 		{
-			_vsize = file_size();
-			
-			_vfile = NewFileCache(_pica_basicP, _vsize);
-			
-			if(_vfile)
+			if((size_t)count >= v->iov_len)
 			{
-				_voffset = tellg_file();
-				
-				seekg_file(0);
-				
-				read_file((char *)_vfile, _vsize);
-				
-				file_cache_path = _path;
-				
-				file_cache_date_time = _modtime;
-				
-				seekg_file(_voffset);
+				count -= v->iov_len;
+				v++;
+				iovcnt--;
+			}
+			else
+			{
+				v->iov_base = (char *)v->iov_base + count;
+				v->iov_len -= count;
+				count = 0;
 			}
 		}
 	}
+	
+	return true;
+#else
+	return (read_file(c, n, pos) && read_file(ahead, ahead_n, pos + n));
+#endif
+}
+
+
+char *
+IStreamPlatform::mappedAt(Int64 pos, int n) const
+{
+	if( !isMemoryMapped() )
+		throw LogicExc("mappedAt() called for non memory-mapped file.");
+	
+	if(pos < 0 || n > (_vsize - pos))
+		throw IoExc("Trying to read past the end of a memory-mapped file.");
+	
+	return ((char *)_vfile + pos);
 }
 
 
 void
-IStreamPlatform::unMemoryMap()
+IStreamPlatform::memoryMap()
 {
-	if( isMemoryMapped() )
+	if( !isMemoryMapped() )
 	{
-		//seekg_file(_voffset); // use if you want to still access the file
+		FileMap *file_map = AcquireFileMap(_path, _modtime);
 		
-		UnlockFileCache(_pica_basicP);
+		if(file_map == NULL)
+		{
+			const Int64 size = _fsize;
+			
+			// a 32-bit process might not have the address space
+			void *map = ((size > 0 && (Int64)(size_t)size == size) ? map_file(size) : NULL);
+			
+			if(map)
+				file_map = AddFileMap(map, size, _path, _modtime);
+		}
 		
-		_vfile = NULL;
+		if(file_map)
+		{
+			_vmap = file_map;
+			_vfile = file_map->map;
+			_vsize = file_map->size;
+			_vprefetched = _pos;
+		}
 	}
 }
 
 
 void
-IStreamPlatform::adopt_cache()
+IStreamPlatform::unMemoryMap()
 {
-	if(file_cacheH == NULL)
-		throw LogicExc("Can't adopt a NULL cache.");
-
-	_vfile = LockFileCache(_pica_basicP);
-	
-	_voffset = tellg_file();
-	
-	_vsize = file_cache_size;
+	if( isMemoryMapped() )
+	{
+		ReleaseFileMap(_vmap);
+		
+		_vmap = NULL;
+		_vfile = NULL;
+	}
 }
 
 
@@ -296,116 +532,409 @@ IStreamPlatform::release_cache()
 }
 
 
-#ifdef __APPLE__
-void
-IStreamPlatform::open_file(const char fileName[])
-{
-	OSErr result = noErr;
-	
-	CFURLRef url = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault, (const UInt8 *)fileName, strlen(fileName) + 1, FALSE);
-	if(url == NULL)
-		throw IoExc ("Couldn't make CFURLRef.");
-	
-	Boolean success = CFURLGetFSRef(url, &_fsRef);
-	CFRelease(url);
-	if(!success)
-		throw IoExc ("Couldn't make FSRef.");
-	
-	HFSUniStr255 dataForkName;
-	result = FSGetDataForkName(&dataForkName);
+// EXR writes lots of little pieces, so collect them and write in big blocks
+static const size_t OStreamBufferSize = 4 * 1024 * 1024;
 
-	result = FSOpenFork(&_fsRef, dataForkName.length, dataForkName.unicode, fsRdPerm, &_refNum);
+// page aligned, the way the OS likes to write them
+static const size_t OStreamBufferAlign = 4096;
 
-	if(result != noErr)
-		throw IoExc ("Couldn't open file for reading.");
-}
+// one being filled while the rest wait to get written
+static const int OStreamWriteBehindBuffers = 4;
 
 
-void
-IStreamPlatform::open_file(const uint16_t fileName[])
+class OStreamPlatform::WriteBehind : public IlmThread::Thread
 {
-	OSErr result = noErr;
+  public:
+	WriteBehind(OStreamPlatform &stream);
+	virtual ~WriteBehind();
 	
-	const int len = PathString::StrLen(fileName);
+	virtual void run();
 	
-	CFStringRef inStr = CFStringCreateWithCharacters(kCFAllocatorDefault, fileName, len);
-	if(inStr == NULL)
-		throw IoExc("Couldn't make CFStringRef.");
-		
-	CFURLRef url = CFURLCreateWithFileSystemPath(kCFAllocatorDefault, inStr, kCFURLPOSIXPathStyle, 0);
-	CFRelease(inStr);
-	if(url == NULL)
-		throw IoExc("Couldn't make CFURLRef.");
+	// waits for a free buffer if they're all in line to be written
+	char *getBuffer();
 	
-	Boolean success = CFURLGetFSRef(url, &_fsRef);
-	CFRelease(url);
-	if(!success)
-		throw IoExc("Couldn't make FSRef.");
+	// hands off a full buffer and gets back an empty one
+	char *queue(char *buf, size_t n, Int64 pos);
 	
-	HFSUniStr255 dataForkName;
-	result = FSGetDataForkName(&dataForkName);
-
-	result = FSOpenFork(&_fsRef, dataForkName.length, dataForkName.unicode, fsRdPerm, &_refNum);
-
-	if(result != noErr)
-		throw IoExc("Couldn't open file for reading.");
-}
+	// waits until everything queued has been written
+	void wait();
+	
+	bool failed();
+	
+  private:
+	typedef struct Block {
+		char	*buf;
+		size_t	n;
+		Int64	pos;
+	} Block;
+	
+	OStreamPlatform &_stream;
+	
+	std::vector<char *> _allocations;
+	std::list<char *> _free;
+	std::list<Block> _queue;
+	
+	IlmThread::Mutex _mutex;
+	IlmThread::Semaphore _queued; // a post for every block in _queue
+	IlmThread::Semaphore _available; // a post for every buffer in _free
+	IlmThread::Semaphore _finished;
+	
+	bool _failed;
+	bool _quit;
+};
 
 
-void
-IStreamPlatform::close_file()
+OStreamPlatform::WriteBehind::WriteBehind(OStreamPlatform &stream) :
+	_stream(stream),
+	_queued(0),
+	_available(OStreamWriteBehindBuffers),
+	_finished(0),
+	_failed(false),
+	_quit(false)
 {
-	if(_refNum == 0)
-		throw LogicExc("_refNum is 0.");
-
-	OSErr result = FSCloseFork(_refNum);
-
-	if(result != noErr)
-		throw IoExc("Error closing file.");
+	for(int i=0; i < OStreamWriteBehindBuffers; i++)
+	{
+		char *mem = new char[OStreamBufferSize + OStreamBufferAlign];
+		
+		_allocations.push_back(mem);
+		
+		const size_t misalign = ((size_t)mem % OStreamBufferAlign);
+		
+		_free.push_back(misalign ? mem + (OStreamBufferAlign - misalign) : mem);
+	}
+	
+	start();
 }
 
 
-bool
-IStreamPlatform::read_file(char c[/*n*/], int n)
+OStreamPlatform::WriteBehind::~WriteBehind()
 {
-	if(_refNum == 0)
-		throw LogicExc("_refNum is 0.");
-
-	ByteCount count = n;
+	{
+		IlmThread::Lock lock(_mutex);
+		
+		_quit = true;
+	}
 	
-	OSErr result = FSReadFork(_refNum, fsAtMark, 0, count, (void *)c, &count);
+	_queued.post();
 	
-	return (result == noErr && count == n);
-}
-
-
-Int64
-IStreamPlatform::tellg_file()
-{
-	if(_refNum == 0)
-		throw LogicExc("_refNum is 0.");
-
-	SInt64 lpos;
-
-	OSErr result = FSGetForkPosition(_refNum, &lpos);
+	_finished.wait(); // Thread has no join
 	
-	if(result != noErr)
-		throw IoExc("Error calling FSGetForkPosition().");
-
-	return lpos;
+	for(std::vector<char *>::iterator i = _allocations.begin(); i != _allocations.end(); ++i)
+		delete [] *i;
 }
 
 
 void
-IStreamPlatform::seekg_file(Int64 pos)
+OStreamPlatform::WriteBehind::run()
 {
-	if(_refNum == 0)
-		throw LogicExc("_refNum is 0.");
-	
-	OSErr result = FSSetForkPosition(_refNum, fsFromStart, pos);
-
+	while(true)
+	{
+		_queued.wait();
+		
+		Block block;
+		bool failed;
+		
+		{
+			IlmThread::Lock lock(_mutex);
+			
+			if( _queue.empty() )
+			{
+				if(_quit)
+					break;
+				else
+					continue;
+			}
+			
+			block = _queue.front();
+			
+			_queue.pop_front();
+			
+			failed = _failed;
+		}
+		
+		// once one write fails, the file is no good anyway
+		if(!failed)
+		{
+			try
+			{
+				_stream.write_file(block.buf, block.n, block.pos);
+			}
+			catch(...)
+			{
+				IlmThread::Lock lock(_mutex);
+				
+				_failed = true;
+			}
+		}
+		
+		{
+			IlmThread::Lock lock(_mutex);
+			
+			_free.push_back(block.buf);
+		}
+		
+		_available.post();
+	}
+	
+	_finished.post();
+}
+
+
+char *
+OStreamPlatform::WriteBehind::getBuffer()
+{
+	_available.wait();
+	
+	IlmThread::Lock lock(_mutex);
+	
+	assert( !_free.empty() );
+	
+	char *buf = _free.front();
+	
+	_free.pop_front();
+	
+	return buf;
+}
+
+
+char *
+OStreamPlatform::WriteBehind::queue(char *buf, size_t n, Int64 pos)
+{
+	{
+		IlmThread::Lock lock(_mutex);
+		
+		Block block = { buf, n, pos };
+		
+		_queue.push_back(block);
+	}
+	
+	_queued.post();
+	
+	return getBuffer();
+}
+
+
+void
+OStreamPlatform::WriteBehind::wait()
+{
+	// the stream is holding one buffer, when we get all the others back there's nothing left to write
+	for(int i=0; i < OStreamWriteBehindBuffers - 1; i++)
+		_available.wait();
+	
+	for(int i=0; i < OStreamWriteBehindBuffers - 1; i++)
+		_available.post();
+}
+
+
+bool
+OStreamPlatform::WriteBehind::failed()
+{
+	IlmThread::Lock lock(_mutex);
+	
+	return _failed;
+}
+
+
+void
+OStreamPlatform::init_buffer(bool write_behind)
+{
+	if(write_behind && IlmThread::supportsThreads())
+	{
+		_behind = new WriteBehind(*this);
+		
+		_buf = _behind->getBuffer();
+	}
+	else
+		_buf = new char[OStreamBufferSize];
+}
+
+
+OStreamPlatform::~OStreamPlatform()
+{
+	try{
+		flush_buffer();
+		
+		if(_behind)
+			_behind->wait();
+	}catch(...) {} // finish() is where errors get reported
+	
+	if(_behind)
+		delete _behind; // owns _buf
+	else
+		delete [] _buf;
+	
+	close_file();
+}
+
+
+void
+OStreamPlatform::write (const char c[/*n*/], int n)
+{
+	if(_buf_used + n > OStreamBufferSize)
+		flush_buffer();
+	
+	if((size_t)n > OStreamBufferSize && _behind == NULL)
+	{
+		// too big to bother buffering
+		write_file(c, n, _pos);
+		
+		_pos += n;
+	}
+	else
+	{
+		while(n > 0)
+		{
+			const size_t count = std::min<size_t>(n, OStreamBufferSize - _buf_used);
+			
+			memcpy(_buf + _buf_used, c, count);
+			
+			_buf_used += count;
+			
+			c += count;
+			n -= count;
+			
+			if(_buf_used == OStreamBufferSize)
+				flush_buffer();
+		}
+	}
+}
+
+
+Int64
+OStreamPlatform::tellp ()
+{
+	return _pos + _buf_used;
+}
+
+
+void
+OStreamPlatform::seekp (Int64 pos)
+{
+	flush_buffer();
+	
+	_pos = pos;
+}
+
+
+void
+OStreamPlatform::finish()
+{
+	flush_buffer();
+	
+	if(_behind)
+	{
+		_behind->wait();
+		
+		if( _behind->failed() )
+			throw IoExc("Not able to write.");
+	}
+	
+	sync_file();
+}
+
+
+void
+OStreamPlatform::flush_buffer()
+{
+	if(_buf_used > 0)
+	{
+		if(_behind)
+			_buf = _behind->queue(_buf, _buf_used, _pos);
+		else
+			write_file(_buf, _buf_used, _pos);
+		
+		_pos += _buf_used;
+		
+		_buf_used = 0;
+	}
+	
+	// find out about it as soon as we can
+	if(_behind && _behind->failed())
+		throw IoExc("Not able to write.");
+}
+
+
+#ifdef __APPLE__
+void
+IStreamPlatform::open_file(const char fileName[])
+{
+	OSErr result = noErr;
+	
+	CFURLRef url = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault, (const UInt8 *)fileName, strlen(fileName) + 1, FALSE);
+	if(url == NULL)
+		throw IoExc ("Couldn't make CFURLRef.");
+	
+	Boolean success = CFURLGetFSRef(url, &_fsRef);
+	CFRelease(url);
+	if(!success)
+		throw IoExc ("Couldn't make FSRef.");
+	
+	HFSUniStr255 dataForkName;
+	result = FSGetDataForkName(&dataForkName);
+
+	result = FSOpenFork(&_fsRef, dataForkName.length, dataForkName.unicode, fsRdPerm, &_refNum);
+
+	if(result != noErr)
+		throw IoExc ("Couldn't open file for reading.");
+}
+
+
+void
+IStreamPlatform::open_file(const uint16_t fileName[])
+{
+	OSErr result = noErr;
+	
+	const int len = PathString::StrLen(fileName);
+	
+	CFStringRef inStr = CFStringCreateWithCharacters(kCFAllocatorDefault, fileName, len);
+	if(inStr == NULL)
+		throw IoExc("Couldn't make CFStringRef.");
+		
+	CFURLRef url = CFURLCreateWithFileSystemPath(kCFAllocatorDefault, inStr, kCFURLPOSIXPathStyle, 0);
+	CFRelease(inStr);
+	if(url == NULL)
+		throw IoExc("Couldn't make CFURLRef.");
+	
+	Boolean success = CFURLGetFSRef(url, &_fsRef);
+	CFRelease(url);
+	if(!success)
+		throw IoExc("Couldn't make FSRef.");
+	
+	HFSUniStr255 dataForkName;
+	result = FSGetDataForkName(&dataForkName);
+
+	result = FSOpenFork(&_fsRef, dataForkName.length, dataForkName.unicode, fsRdPerm, &_refNum);
+
+	if(result != noErr)
+		throw IoExc("Couldn't open file for reading.");
+}
+
+
+void
+IStreamPlatform::close_file()
+{
+	if(_refNum == 0)
+		throw LogicExc("_refNum is 0.");
+
+	OSErr result = FSCloseFork(_refNum);
+
 	if(result != noErr)
-		throw IoExc("Error calling FSSetForkPosition().");
+		throw IoExc("Error closing file.");
+}
+
+
+bool
+IStreamPlatform::read_file(char c[/*n*/], int n, Int64 pos) const
+{
+	if(_refNum == 0)
+		throw LogicExc("_refNum is 0.");
+
+	ByteCount count = n;
+	
+	// always from the start, we don't use the fork's mark
+	OSErr result = FSReadFork(_refNum, fsFromStart, pos, count, (void *)c, &count);
+	
+	return (result == noErr && count == n);
 }
 
 
@@ -443,8 +972,36 @@ IStreamPlatform::file_modtime()
 }
 
 
-OStreamPlatform::OStreamPlatform(const char fileName[]):
-	OStream(fileName)
+void *
+IStreamPlatform::map_file(Int64 size)
+{
+	// mmap needs a file descriptor, which an FSRef can't give us
+	char path[PATH_MAX];
+	
+	OSStatus result = FSRefMakePath(&_fsRef, (UInt8 *)path, PATH_MAX);
+	
+	if(result != noErr)
+		return NULL;
+	
+	int fd = open(path, O_RDONLY);
+	
+	if(fd < 0)
+		return NULL;
+	
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	
+	close(fd); // the mapping keeps its own reference to the file
+	
+	return (map == MAP_FAILED ? NULL : map);
+}
+
+
+OStreamPlatform::OStreamPlatform(const char fileName[], bool write_behind):
+	OStream(fileName),
+	_behind(NULL),
+	_pos(0),
+	_buf(NULL),
+	_buf_used(0)
 {
 	OSErr result = noErr;
 	
@@ -512,11 +1069,17 @@ OStreamPlatform::OStreamPlatform(const char fileName[]):
 
 	if(result != noErr)
 		throw IoExc("Couldn't open file for writing.");
+	
+	init_buffer(write_behind);
 }
 
 
-OStreamPlatform::OStreamPlatform(const uint16_t fileName[]):
-	OStream("Unicode Path")
+OStreamPlatform::OStreamPlatform(const uint16_t fileName[], bool write_behind):
+	OStream("Unicode Path"),
+	_behind(NULL),
+	_pos(0),
+	_buf(NULL),
+	_buf_used(0)
 {
 	OSErr result = noErr;
 	
@@ -586,70 +1149,110 @@ OStreamPlatform::OStreamPlatform(const uint16_t fileName[]):
 
 	if(result != noErr)
 		throw IoExc("Couldn't open file for reading.");
-}
-
-
-OStreamPlatform::~OStreamPlatform()
-{
-	OSErr result = FSCloseFork(_refNum);
-
-	assert(result == noErr);
+	
+	init_buffer(write_behind);
 }
 
 
 void
-OStreamPlatform::write (const char c[/*n*/], int n)
+OStreamPlatform::write_file(const char *c, size_t n, Int64 pos)
 {
 	ByteCount count = n;
 
-	OSErr result = FSWriteFork(_refNum, fsAtMark, 0, count, (const void *)c, &count);
+	OSErr result = FSWriteFork(_refNum, fsFromStart, pos, count, (const void *)c, &count);
 
 	if(count != n || result != noErr)
 		throw IoExc("Not able to write.");
 }
 
 
-Int64
-OStreamPlatform::tellp ()
+void
+OStreamPlatform::sync_file()
 {
-	Int64 pos;
-	SInt64 lpos;
-
-	OSErr result = FSGetForkPosition(_refNum, &lpos);
+	OSErr result = FSFlushFork(_refNum);
 	
 	if(result != noErr)
-		throw IoExc("Error calling FSGetForkPosition().");
-
-	pos = lpos;
-	
-	return pos;
+		throw IoExc("Error calling FSFlushFork().");
 }
 
 
 void
-OStreamPlatform::seekp (Int64 pos)
+OStreamPlatform::close_file()
 {
-	OSErr result = FSSetForkPosition(_refNum, fsFromStart, pos);
+	OSErr result = FSCloseFork(_refNum);
 
-	if(result != noErr)
-		throw IoExc("Error calling FSSetForkPosition().");
+	assert(result == noErr);
 }
-#endif // __APPLE__
 
-#ifdef WIN32
-void
-IStreamPlatform::open_file(const char fileName[])
-{
-	_hFile = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 
-	if(_hFile == INVALID_HANDLE_VALUE)
-		throw IoExc("Couldn't open file.");
-}
+static bool
+GetFSRefStats(const FSRef &fsRef, Int64 &size, DateTime &modtime)
+{
+	FSCatalogInfo cat;
+
+	OSErr result = FSGetCatalogInfo(&fsRef, kFSCatInfoContentMod | kFSCatInfoDataSizes, &cat, NULL, NULL, NULL);
+	
+	if(result != noErr)
+		return false;
+	
+	size = cat.dataLogicalSize;
+	modtime = cat.contentModDate;
+	
+	return true;
+}
+
+
+bool
+GetFileStats(const char path[], Int64 &size, DateTime &modtime)
+{
+	CFURLRef url = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault, (const UInt8 *)path, strlen(path) + 1, FALSE);
+	if(url == NULL)
+		return false;
+	
+	FSRef fsRef;
+	Boolean success = CFURLGetFSRef(url, &fsRef);
+	CFRelease(url);
+	
+	return (success && GetFSRefStats(fsRef, size, modtime));
+}
+
+
+bool
+GetFileStats(const uint16_t path[], Int64 &size, DateTime &modtime)
+{
+	CFStringRef inStr = CFStringCreateWithCharacters(kCFAllocatorDefault, path, PathString::StrLen(path));
+	if(inStr == NULL)
+		return false;
+	
+	CFURLRef url = CFURLCreateWithFileSystemPath(kCFAllocatorDefault, inStr, kCFURLPOSIXPathStyle, 0);
+	CFRelease(inStr);
+	if(url == NULL)
+		return false;
+	
+	FSRef fsRef;
+	Boolean success = CFURLGetFSRef(url, &fsRef);
+	CFRelease(url);
+	
+	return (success && GetFSRefStats(fsRef, size, modtime));
+}
+#endif // __APPLE__
+
+#ifdef WIN32
+void
+IStreamPlatform::open_file(const char fileName[])
+{
+	// OpenEXR_FileCache keeps files open, don't lock out a renderer writing a new version
+	// overlapped, so reads from different threads don't wait for each other
+	_hFile = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+
+	if(_hFile == INVALID_HANDLE_VALUE)
+		throw IoExc("Couldn't open file.");
+}
 
 void
 IStreamPlatform::open_file(const uint16_t fileName[])
 {
-	_hFile = CreateFileW((LPCWSTR)fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	_hFile = CreateFileW((LPCWSTR)fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
 
 	if(_hFile == INVALID_HANDLE_VALUE)
 		throw IoExc("Couldn't open file.");
@@ -667,53 +1270,43 @@ IStreamPlatform::close_file()
 
 
 bool
-IStreamPlatform::read_file(char c[/*n*/], int n)
+IStreamPlatform::read_file(char c[/*n*/], int n, Int64 pos) const
 {
+	OVERLAPPED overlapped;
+	
+	memset(&overlapped, 0, sizeof(overlapped));
+	
+	overlapped.Offset = (DWORD)(pos & 0xffffffff);
+	overlapped.OffsetHigh = (DWORD)(pos >> 32);
+	overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	
+	if(overlapped.hEvent == NULL)
+		throw IoExc("Error calling CreateEvent().");
+	
 	DWORD count = n, out = 0;
 	
-	BOOL result = ReadFile(_hFile, (LPVOID)c, count, &out, NULL);
+	BOOL result = ReadFile(_hFile, (LPVOID)c, count, &out, &overlapped);
+	
+	if(!result && GetLastError() == ERROR_IO_PENDING)
+		result = GetOverlappedResult(_hFile, &overlapped, &out, TRUE);
+	
+	CloseHandle(overlapped.hEvent);
 
 	return (result && count == out);
 }
 
 
 Int64
-IStreamPlatform::tellg_file()
+IStreamPlatform::file_size()
 {
-	Int64 pos;
-	LARGE_INTEGER lpos, zero;
-
-	zero.QuadPart = 0;
-
-	BOOL result = SetFilePointerEx(_hFile, zero, &lpos, FILE_CURRENT);
-
+	LARGE_INTEGER size;
+	
+	BOOL result = GetFileSizeEx(_hFile, &size);
+	
 	if(!result)
-		throw IoExc("Error calling SetFilePointerEx().");
-
-	pos = lpos.QuadPart;
+		throw IoExc("Error calling GetFileSizeEx().");
 	
-	return pos;
-}
-
-
-void
-IStreamPlatform::seekg_file(Int64 pos)
-{
-	LARGE_INTEGER lpos, out;
-
-	lpos.QuadPart = pos;
-
-	BOOL result = SetFilePointerEx(_hFile, lpos, &out, FILE_BEGIN);
-
-	if(!result || lpos.QuadPart != out.QuadPart)
-		throw IoExc("Error calling SetFilePointerEx().");
-}
-
-
-Int64
-IStreamPlatform::file_size()
-{
-	return GetFileSize(_hFile, NULL);
+	return size.QuadPart;
 }
 
 
@@ -728,27 +1321,86 @@ IStreamPlatform::file_modtime()
 }
 
 
-OStreamPlatform::OStreamPlatform(const char fileName[]):
-	OStream(fileName)
+void *
+IStreamPlatform::map_file(Int64 size)
+{
+	HANDLE hMapping = CreateFileMapping(_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	
+	if(hMapping == NULL)
+		return NULL;
+	
+	void *map = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	
+	CloseHandle(hMapping); // the view keeps the mapping open
+	
+	return map;
+}
+
+
+OStreamPlatform::OStreamPlatform(const char fileName[], bool write_behind):
+	OStream(fileName),
+	_behind(NULL),
+	_pos(0),
+	_buf(NULL),
+	_buf_used(0)
 {
 	_hFile = CreateFile(fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 
 	if(_hFile == INVALID_HANDLE_VALUE)
 		throw IoExc("Couldn't open file.");
+	
+	init_buffer(write_behind);
 }
 
 
-OStreamPlatform::OStreamPlatform(const uint16_t fileName[]):
-	OStream("Unicode Path")
+OStreamPlatform::OStreamPlatform(const uint16_t fileName[], bool write_behind):
+	OStream("Unicode Path"),
+	_behind(NULL),
+	_pos(0),
+	_buf(NULL),
+	_buf_used(0)
 {
 	_hFile = CreateFileW((LPCWSTR)fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 
 	if(_hFile == INVALID_HANDLE_VALUE)
 		throw IoExc("Couldn't open file.");
+	
+	init_buffer(write_behind);
 }
 
 
-OStreamPlatform::~OStreamPlatform()
+void
+OStreamPlatform::write_file(const char *c, size_t n, Int64 pos)
+{
+	// the handle isn't overlapped, so this still waits, but it takes the position from here
+	OVERLAPPED overlapped;
+	
+	memset(&overlapped, 0, sizeof(overlapped));
+	
+	overlapped.Offset = (DWORD)(pos & 0xffffffff);
+	overlapped.OffsetHigh = (DWORD)(pos >> 32);
+	
+	DWORD count = n, out = 0;
+	
+	BOOL result = WriteFile(_hFile, (LPCVOID)c, count, &out, &overlapped);
+
+	if(!result || out != count)
+		throw IoExc("Not able to write.");
+}
+
+
+void
+OStreamPlatform::sync_file()
+{
+	BOOL result = FlushFileBuffers(_hFile);
+	
+	if(!result)
+		throw IoExc("Error calling FlushFileBuffers().");
+}
+
+
+void
+OStreamPlatform::close_file()
 {
 	BOOL result = CloseHandle(_hFile);
 
@@ -756,50 +1408,223 @@ OStreamPlatform::~OStreamPlatform()
 }
 
 
+bool
+GetFileStats(const char path[], Int64 &size, DateTime &modtime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	
+	if( !GetFileAttributesExA(path, GetFileExInfoStandard, &data) )
+		return false;
+	
+	size = ((Int64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	modtime = data.ftLastWriteTime;
+	
+	return true;
+}
+
+
+bool
+GetFileStats(const uint16_t path[], Int64 &size, DateTime &modtime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	
+	if( !GetFileAttributesExW((LPCWSTR)path, GetFileExInfoStandard, &data) )
+		return false;
+	
+	size = ((Int64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	modtime = data.ftLastWriteTime;
+	
+	return true;
+}
+#endif // WIN32
+
+#if !defined(__APPLE__) && !defined(WIN32)
+void
+IStreamPlatform::open_file(const char fileName[])
+{
+	_fd = open(fileName, O_RDONLY);
+	
+	if(_fd < 0)
+		throw IoExc("Couldn't open file.");
+}
+
+
 void
-OStreamPlatform::write (const char c[/*n*/], int n)
+IStreamPlatform::open_file(const uint16_t fileName[])
 {
-	DWORD count = n, out = 0;
+	const std::string utf8_path = UTF16toUTF8(fileName);
 	
-	BOOL result = WriteFile(_hFile, (LPVOID)c, count, &out, NULL);
+	open_file( utf8_path.c_str() );
+}
 
-	if(!result || out != count)
-		throw IoExc("Not able to write.");
+
+void
+IStreamPlatform::close_file()
+{
+	int result = close(_fd);
+	
+	if(result != 0)
+		throw IoExc("Error closing file.");
+}
+
+
+bool
+IStreamPlatform::read_file(char c[/*n*/], int n, Int64 pos) const
+{
+	// pread() doesn't touch the fd's position, so threads can read at once
+	while(n > 0)
+	{
+		ssize_t count = pread(_fd, c, n, pos);
+		
+		if(count < 0 && errno == EINTR)
+			continue;
+		
+		if(count <= 0)
+			return false;
+		
+		c += count;
+		n -= count;
+		pos += count;
+	}
+	
+	return true;
 }
 
 
 Int64
-OStreamPlatform::tellp ()
+IStreamPlatform::file_size()
 {
-	Int64 pos;
-	LARGE_INTEGER lpos, zero;
+	struct stat st;
+	
+	if(fstat(_fd, &st) != 0)
+		throw IoExc("Error calling fstat().");
+	
+	return st.st_size;
+}
+
 
-	zero.QuadPart = 0;
+DateTime
+IStreamPlatform::file_modtime()
+{
+	struct stat st;
+	
+	if(fstat(_fd, &st) != 0)
+		throw IoExc("Error calling fstat().");
+	
+	return st.st_mtim;
+}
 
-	BOOL result = SetFilePointerEx(_hFile, zero, &lpos, FILE_CURRENT);
 
-	if(!result)
-		throw IoExc("Error calling SetFilePointerEx().");
+void *
+IStreamPlatform::map_file(Int64 size)
+{
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, _fd, 0);
+	
+	return (map == MAP_FAILED ? NULL : map);
+}
 
-	pos = lpos.QuadPart;
+
+static void
+WriteFully(int fd, const char *c, size_t n, Int64 pos)
+{
+	while(n > 0)
+	{
+		ssize_t count = pwrite(fd, c, n, pos);
+		
+		if(count < 0 && errno == EINTR)
+			continue;
+		
+		if(count <= 0)
+			throw IoExc("Not able to write.");
+		
+		c += count;
+		n -= count;
+		pos += count;
+	}
+}
+
+
+OStreamPlatform::OStreamPlatform(const char fileName[], bool write_behind):
+	OStream(fileName),
+	_behind(NULL),
+	_pos(0),
+	_buf(NULL),
+	_buf_used(0)
+{
+	_fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	
+	if(_fd < 0)
+		throw IoExc("Couldn't open file.");
+	
+	init_buffer(write_behind);
+}
+
+
+OStreamPlatform::OStreamPlatform(const uint16_t fileName[], bool write_behind):
+	OStream("Unicode Path"),
+	_behind(NULL),
+	_pos(0),
+	_buf(NULL),
+	_buf_used(0)
+{
+	const std::string utf8_path = UTF16toUTF8(fileName);
+	
+	_fd = open(utf8_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
 	
-	return pos;
+	if(_fd < 0)
+		throw IoExc("Couldn't open file.");
+	
+	init_buffer(write_behind);
 }
 
 
 void
-OStreamPlatform::seekp (Int64 pos)
+OStreamPlatform::write_file(const char *c, size_t n, Int64 pos)
 {
-	LARGE_INTEGER lpos;
+	WriteFully(_fd, c, n, pos);
+}
 
-	lpos.QuadPart = pos;
 
-	BOOL result = SetFilePointerEx(_hFile, lpos, NULL, FILE_BEGIN);
+void
+OStreamPlatform::sync_file()
+{
+	if(fsync(_fd) != 0)
+		throw IoExc("Error calling fsync().");
+}
 
-	if(!result)
-		throw IoExc("Error calling SetFilePointerEx().");
+
+void
+OStreamPlatform::close_file()
+{
+	int result = close(_fd);
+	
+	assert(result == 0);
 }
-#endif // WIN32
+
+
+bool
+GetFileStats(const char path[], Int64 &size, DateTime &modtime)
+{
+	struct stat st;
+	
+	if(stat(path, &st) != 0)
+		return false;
+	
+	size = st.st_size;
+	modtime = st.st_mtim;
+	
+	return true;
+}
+
+
+bool
+GetFileStats(const uint16_t path[], Int64 &size, DateTime &modtime)
+{
+	const std::string utf8_path = UTF16toUTF8(path);
+	
+	return GetFileStats(utf8_path.c_str(), size, modtime);
+}
+#endif // !__APPLE__ && !WIN32
 
 
 #pragma mark-
@@ -933,3 +1758,740 @@ PathString::StrCpy(T *ostr, const T *istr)
 		*ostr++ = *istr;
 	}while(*istr++ != '\0');
 }
+
+
+#pragma mark-
+
+
+IStreamPlatformCursor::IStreamPlatformCursor(const IStreamPlatform &stream) :
+	IStream( stream.fileName() ),
+	_stream(stream),
+	_pos(0)
+{
+
+}
+
+
+bool
+IStreamPlatformCursor::isMemoryMapped() const
+{
+	return _stream.isMemoryMapped();
+}
+
+
+bool
+IStreamPlatformCursor::read(char c[/*n*/], int n)
+{
+	const bool success = (_stream.isMemoryMapped() ? _stream.readAt(c, n, _pos) : _reader.read(_stream, c, n, _pos));
+	
+	if(success)
+		_pos += n;
+	
+	return success;
+}
+
+
+char *
+IStreamPlatformCursor::readMemoryMapped(int n)
+{
+	char *ptr = _stream.mappedAt(_pos, n);
+	
+	_pos += n;
+	
+	return ptr;
+}
+
+
+Int64
+IStreamPlatformCursor::tellg()
+{
+	return _pos;
+}
+
+
+void
+IStreamPlatformCursor::seekg(Int64 pos)
+{
+	if(pos < 0)
+		throw IoExc("Trying to seek before the start of the file.");
+	
+	_pos = pos;
+}
+
+
+#pragma mark-
+
+
+IStreamMemory::IStreamMemory(const char *buf, size_t len, const char fileName[]) :
+	IStream(fileName),
+	_buf(buf),
+	_len(len),
+	_pos(0)
+{
+
+}
+
+
+bool
+IStreamMemory::read(char c[/*n*/], int n)
+{
+	if(n < 0 || n > (_len - _pos))
+		throw IoExc("Trying to read past the end of a memory stream.");
+	
+	memcpy(c, _buf + _pos, n);
+	
+	_pos += n;
+	
+	return (_pos < _len);
+}
+
+
+Int64
+IStreamMemory::tellg()
+{
+	return _pos;
+}
+
+
+void
+IStreamMemory::seekg(Int64 pos)
+{
+	if(pos < 0 || pos > _len)
+		throw IoExc("Trying to seek outside a memory stream.");
+	
+	_pos = pos;
+}
+
+
+#pragma mark-
+
+
+static const size_t CoalesceSize = 1024 * 1024;
+
+
+CoalescedReader::CoalescedReader() :
+	_buf(NULL),
+	_buf_pos(0),
+	_buf_len(0)
+{
+
+}
+
+
+CoalescedReader::~CoalescedReader()
+{
+	delete [] _buf;
+}
+
+
+bool
+CoalescedReader::read(const IStreamPlatform &stream, char c[/*n*/], int n, Int64 pos)
+{
+	// whatever we already have
+	if(pos >= _buf_pos && pos < _buf_pos + (Int64)_buf_len)
+	{
+		const size_t offset = pos - _buf_pos;
+		const size_t count = std::min<size_t>(n, _buf_len - offset);
+		
+		memcpy(c, _buf + offset, count);
+		
+		c += count;
+		n -= count;
+		pos += count;
+		
+		if(n == 0)
+			return true;
+	}
+	
+	if(pos < 0 || n > (stream.size() - pos))
+		return false;
+	
+	if(_buf == NULL)
+		_buf = new char[CoalesceSize];
+	
+	_buf_len = 0;
+	
+	if((size_t)n < CoalesceSize / 2)
+	{
+		// a small read, so fill the buffer from here and copy it out
+		const size_t fill = std::min<Int64>(CoalesceSize, stream.size() - pos);
+		
+		if( !stream.readAt(_buf, fill, pos) )
+			return false;
+		
+		_buf_pos = pos;
+		_buf_len = fill;
+		
+		memcpy(c, _buf, n);
+	}
+	else
+	{
+		// a big read goes straight to the caller, the buffer gets what's after it
+		const size_t ahead = std::min<Int64>(CoalesceSize, stream.size() - (pos + n));
+		
+		if( !stream.readAt(c, n, pos, _buf, ahead) )
+			return false;
+		
+		_buf_pos = pos + n;
+		_buf_len = ahead;
+	}
+	
+	return true;
+}
+
+
+#pragma mark-
+
+
+class SequenceReadAhead::Worker : public IlmThread::Thread
+{
+  public:
+	Worker(SequenceReadAhead &read_ahead) : _read_ahead(read_ahead) { start(); }
+	virtual ~Worker() {}
+	
+	virtual void run();
+	
+  private:
+	SequenceReadAhead &_read_ahead;
+};
+
+
+void
+SequenceReadAhead::Worker::run()
+{
+	PathString path;
+	
+	while( _read_ahead.nextFrame(path) )
+	{
+		_read_ahead.warmFrame(path);
+	}
+	
+	_read_ahead._finished.post(); // Thread has no join
+}
+
+
+SequenceReadAhead::SequenceReadAhead() :
+	_frames(0),
+	_memory_map(false),
+	_worker(NULL),
+	_work(0),
+	_finished(0),
+	_quit(false),
+	_next_id(0),
+	_current_sequence(-1),
+	_cancel_current(false)
+{
+
+}
+
+
+SequenceReadAhead::~SequenceReadAhead()
+{
+	configure(0, false);
+}
+
+
+void
+SequenceReadAhead::configure(int frames, bool memory_map)
+{
+	if(frames <= 0 && _worker != NULL)
+	{
+		{
+			IlmThread::Lock lock(_mutex);
+			
+			_quit = true;
+			_cancel_current = true;
+			
+			_queue.clear();
+		}
+		
+		_work.post();
+		
+		_finished.wait();
+		
+		delete _worker;
+		
+		_worker = NULL;
+		
+		_quit = false;
+	}
+	
+	{
+		IlmThread::Lock lock(_mutex);
+		
+		_memory_map = memory_map;
+	}
+	
+	_frames = std::max(frames, 0);
+	
+	if(_frames > 0 && _worker == NULL && IlmThread::supportsThreads())
+	{
+		try
+		{
+			_worker = new Worker(*this);
+		}
+		catch(...) { _frames = 0; }
+	}
+}
+
+
+// splits "/path/shot.0123.exr" into "/path/shot.", 123 (4 digits) and ".exr"
+static bool
+SplitFramePath(const A_PathType *path, std::vector<A_PathType> &prefix, long &frame, int &digits, std::vector<A_PathType> &suffix)
+{
+	const int len = PathString::StrLen(path);
+	
+	int ext = len;
+	
+	for(int i = len - 1; i >= 0 && path[i] != '/' && path[i] != '\\'; i--)
+	{
+		if(path[i] == '.')
+		{
+			ext = i;
+			break;
+		}
+	}
+	
+	int start = ext;
+	
+	while(start > 0 && path[start - 1] >= '0' && path[start - 1] <= '9')
+		start--;
+	
+	digits = ext - start;
+	
+	if(digits == 0 || digits > 9)
+		return false;
+	
+	frame = 0;
+	
+	for(int i = start; i < ext; i++)
+		frame = (frame * 10) + (path[i] - '0');
+	
+	prefix.assign(path, path + start);
+	suffix.assign(path + ext, path + len);
+	
+	return true;
+}
+
+
+static PathString
+FramePath(const std::vector<A_PathType> &prefix, long frame, int digits, const std::vector<A_PathType> &suffix)
+{
+	char num[32];
+	
+	sprintf(num, "%0*ld", digits, frame);
+	
+	std::vector<A_PathType> path(prefix);
+	
+	for(const char *c = num; *c != '\0'; c++)
+		path.push_back(*c);
+	
+	path.insert(path.end(), suffix.begin(), suffix.end());
+	
+	path.push_back('\0');
+	
+	return PathString(&path[0]);
+}
+
+
+void
+SequenceReadAhead::frameRequested(const PathString &path, Int64 file_size)
+{
+	if(_worker == NULL)
+		return;
+	
+	PathChars prefix, suffix;
+	long frame;
+	int digits;
+	
+	if( !SplitFramePath(path.string(), prefix, frame, digits, suffix) )
+		return;
+	
+	
+	IlmThread::Lock lock(_mutex);
+	
+	std::list<Sequence>::iterator seq = _sequences.begin();
+	
+	while(seq != _sequences.end() && !(seq->prefix == prefix && seq->suffix == suffix))
+		++seq;
+	
+	if(seq == _sequences.end())
+	{
+		Sequence new_seq;
+		
+		new_seq.id = _next_id++;
+		new_seq.prefix = prefix;
+		new_seq.suffix = suffix;
+		new_seq.digits = digits;
+		new_seq.last_frame = frame;
+		new_seq.queued_through = frame;
+		
+		_sequences.push_front(new_seq);
+		
+		while(_sequences.size() > 8)
+		{
+			cancelSequence(_sequences.back().id);
+			
+			_sequences.pop_back();
+		}
+		
+		return; // nothing to go on yet
+	}
+	
+	_sequences.splice(_sequences.begin(), _sequences, seq);
+	
+	
+	const long step = frame - seq->last_frame;
+	
+	if(step == 0)
+		return; // same frame again, maybe a different layer
+	
+	seq->last_frame = frame;
+	
+	if(step != 1 && step != -1)
+	{
+		// playhead jumped, whatever we were reading is no good
+		cancelSequence(seq->id);
+		
+		seq->queued_through = frame;
+		
+		return;
+	}
+	
+	
+	// don't read ahead more than the map cache can hold without throwing out what we read
+	int frames = _frames;
+	
+	if(_memory_map && file_maps_max_bytes > 0 && file_size > 0)
+		frames = std::min<Int64>(frames, file_maps_max_bytes / (2 * file_size));
+	
+	const long last = frame + (step * frames);
+	
+	long next = ((seq->queued_through - frame) * step > 0 ? seq->queued_through + step : frame + step);
+	
+	while((last - next) * step >= 0)
+	{
+		if(next >= 0)
+		{
+			QueuedFrame queued;
+			
+			queued.sequence = seq->id;
+			queued.path = FramePath(prefix, next, seq->digits, suffix);
+			
+			_queue.push_back(queued);
+			
+			_work.post();
+		}
+		
+		seq->queued_through = next;
+		
+		next += step;
+	}
+}
+
+
+// call with _mutex locked
+void
+SequenceReadAhead::cancelSequence(int id)
+{
+	std::list<QueuedFrame>::iterator i = _queue.begin();
+	
+	while(i != _queue.end())
+	{
+		if(i->sequence == id)
+			i = _queue.erase(i);
+		else
+			++i;
+	}
+	
+	if(_current_sequence == id)
+		_cancel_current = true;
+}
+
+
+bool
+SequenceReadAhead::nextFrame(PathString &path)
+{
+	while(true)
+	{
+		_work.wait();
+		
+		IlmThread::Lock lock(_mutex);
+		
+		if(_quit)
+			return false;
+		
+		if( !_queue.empty() )
+		{
+			path = _queue.front().path;
+			
+			_current_sequence = _queue.front().sequence;
+			_cancel_current = false;
+			
+			_queue.pop_front();
+			
+			return true;
+		}
+		
+		// the frame this post was for got cancelled
+	}
+}
+
+
+bool
+SequenceReadAhead::frameCancelled()
+{
+	IlmThread::Lock lock(_mutex);
+	
+	return _cancel_current;
+}
+
+
+void
+SequenceReadAhead::warmFrame(const PathString &path)
+{
+	bool memory_map = false;
+	
+	{
+		IlmThread::Lock lock(_mutex);
+		
+		memory_map = _memory_map;
+	}
+	
+	const Int64 page_size = 4096;
+	const Int64 check_every = 256 * page_size;
+	
+	try
+	{
+		IStreamPlatform stream( path.string() );
+		
+		if(memory_map)
+		{
+			stream.memoryMap();
+			
+			if( stream.isMemoryMapped() )
+			{
+				// touch every page now, so the drawing thread doesn't wait on them
+				const char *data = stream.mappedAt(0, 0);
+				
+				volatile char touch = 0;
+				
+				for(Int64 i = 0; i < stream.size(); i += page_size)
+				{
+					touch += data[i];
+					
+					if(i % check_every == 0 && frameCancelled())
+						break;
+				}
+			}
+			
+			// the mapping stays in the cache when the stream goes away
+		}
+		else
+		{
+			// just read it through, the OS keeps the pages in its file cache
+			std::vector<char> buf(check_every);
+			
+			for(Int64 i = 0; i < stream.size() && !frameCancelled(); i += check_every)
+			{
+				const int n = std::min<Int64>(check_every, stream.size() - i);
+				
+				if( !stream.readAt(&buf[0], n, i) )
+					break;
+			}
+		}
+	}
+	catch(...) {} // probably the end of the sequence
+}
+
+
+#pragma mark-
+
+
+class BackgroundJobs::Worker : public IlmThread::Thread
+{
+  public:
+	Worker(BackgroundJobs &jobs) : _jobs(jobs) { start(); }
+	virtual ~Worker() {}
+	
+	virtual void run();
+	
+  private:
+	BackgroundJobs &_jobs;
+};
+
+
+void
+BackgroundJobs::Worker::run()
+{
+	Job *job = NULL;
+	
+	while( (job = _jobs.nextJob()) != NULL )
+	{
+		_jobs.runJob(job);
+	}
+	
+	_jobs._finished.post(); // Thread has no join
+}
+
+
+BackgroundJobs::BackgroundJobs() :
+	_max_jobs(0),
+	_worker(NULL),
+	_work(0),
+	_slots(0),
+	_finished(0),
+	_failed(false)
+{
+
+}
+
+
+BackgroundJobs::~BackgroundJobs()
+{
+	try
+	{
+		configure(0);
+	}
+	catch(...) {}
+}
+
+
+void
+BackgroundJobs::configure(int max_jobs)
+{
+	max_jobs = std::max(max_jobs, 0);
+	
+	if(_worker != NULL && max_jobs != _max_jobs)
+	{
+		// waking up to an empty queue means quit,
+		// after the jobs that were queued before
+		_work.post();
+		
+		_finished.wait();
+		
+		delete _worker;
+		
+		_worker = NULL;
+	}
+	
+	// with the thread stopped, every slot is free
+	while(_max_jobs < max_jobs)
+	{
+		_slots.post();
+		_max_jobs++;
+	}
+	
+	while(_max_jobs > max_jobs)
+	{
+		_slots.wait();
+		_max_jobs--;
+	}
+	
+	if(_max_jobs > 0 && _worker == NULL && IlmThread::supportsThreads())
+	{
+		try
+		{
+			_worker = new Worker(*this);
+		}
+		catch(...) {}
+	}
+}
+
+
+void
+BackgroundJobs::queue(Job *job)
+{
+	std::auto_ptr<Job> the_job(job);
+	
+	throwError();
+	
+	_slots.wait();
+	
+	{
+		IlmThread::Lock lock(_mutex);
+		
+		_queue.push_back( the_job.release() );
+	}
+	
+	_work.post();
+}
+
+
+void
+BackgroundJobs::finish()
+{
+	// once we have every slot, nothing is queued or running
+	for(int i=0; i < _max_jobs; i++)
+		_slots.wait();
+	
+	for(int i=0; i < _max_jobs; i++)
+		_slots.post();
+	
+	throwError();
+}
+
+
+BackgroundJobs::Job *
+BackgroundJobs::nextJob()
+{
+	_work.wait();
+	
+	IlmThread::Lock lock(_mutex);
+	
+	if( _queue.empty() )
+		return NULL;
+	
+	Job *job = _queue.front();
+	
+	_queue.pop_front();
+	
+	return job;
+}
+
+
+void
+BackgroundJobs::runJob(Job *job)
+{
+	std::string error;
+	bool failed = false;
+	
+	try
+	{
+		job->run();
+	}
+	catch(const std::exception &e) { failed = true; error = e.what(); }
+	catch(...) { failed = true; error = "Unknown error in background job."; }
+	
+	delete job;
+	
+	if(failed)
+	{
+		IlmThread::Lock lock(_mutex);
+		
+		if(!_failed)
+		{
+			_failed = true;
+			_error = error;
+		}
+	}
+	
+	_slots.post();
+}
+
+
+void
+BackgroundJobs::throwError()
+{
+	IlmThread::Lock lock(_mutex);
+	
+	if(_failed)
+	{
+		const std::string error = _error;
+		
+		_failed = false;
+		_error.clear();
+		
+		throw IoExc(error);
+	}
+}
@@ -13,6 +13,13 @@
 
 #include "fnord_SuiteHandler.h"
 
+#include <IlmThreadMutex.h>
+#include <IlmThreadSemaphore.h>
+
+#include <list>
+#include <vector>
+#include <string>
+
 
 #ifdef WIN32
 #include <Windows.h>
@@ -32,6 +39,12 @@ typedef SInt16 FSIORefNum;
 #endif
 #endif // __APPLE__
 
+#if !defined(__APPLE__) && !defined(WIN32)
+#include <stdint.h>
+#include <time.h>
+typedef struct timespec DateTime;
+#endif
+
 
 class PathString
 {
@@ -60,7 +73,39 @@ class PathString
 };
 
 
-void DeleteFileCache(const SPBasicSuite *pica_basicP, int timeout=0);
+// memory mapped files that aren't being used stick around until these go
+void ConfigureFileCache(Imf::Int64 max_bytes);
+void DeleteFileCache(int timeout=0);
+void DeleteFileMaps(const PathString &path); // before writing over the file
+
+// size and mod time without opening the file, false if we can't get them
+bool GetFileStats(const char path[], Imf::Int64 &size, DateTime &modtime);
+bool GetFileStats(const uint16_t path[], Imf::Int64 &size, DateTime &modtime);
+
+bool MatchDateTime(const DateTime &d1, const DateTime &d2);
+
+
+struct FileMap;
+
+class IStreamPlatform;
+
+
+// OpenEXR reads every chunk with a seek and a few small reads, which is a lot of
+// round trips to a file server.  This reads ahead in big blocks, so the chunks
+// that come next in the file are already in memory.
+class CoalescedReader
+{
+  public:
+	CoalescedReader();
+	~CoalescedReader();
+	
+	bool read(const IStreamPlatform &stream, char c[/*n*/], int n, Imf::Int64 pos);
+	
+  private:
+	char *_buf;
+	Imf::Int64 _buf_pos;
+	size_t _buf_len;
+};
 
 
 class IStreamPlatform : public Imf::IStream
@@ -78,34 +123,48 @@ class IStreamPlatform : public Imf::IStream
 	virtual Imf::Int64 tellg();
 	virtual void seekg(Imf::Int64 pos);
 	
-	// function to load the file into a buffer and start memory mapping
+	// map the file into memory and read from that
 	void memoryMap();
 	void unMemoryMap();
 	
+	// Reads without using or moving the stream's position, so several
+	// threads can read at once.  Safe to call while mapped or not.
+	bool readAt(char c[/*n*/], int n, Imf::Int64 pos) const;
+	char *mappedAt(Imf::Int64 pos, int n) const;
+	
+	// same, but also reads what comes right after into ahead (in one call if we can)
+	bool readAt(char c[/*n*/], int n, Imf::Int64 pos, char *ahead, size_t ahead_n) const;
+	
+	Imf::Int64 size() const { return _fsize; }
+	
 	// access information relevant to caching
 	const PathString & getPath() const { return _path; }
 	DateTime getModTime() const { return _modtime; }
 	
   private:
-	void adopt_cache();
 	void release_cache();
 
   private:
 	void open_file(const char fileName[]);
 	void open_file(const uint16_t fileName[]);
 	void close_file();
-	bool read_file(char c[/*n*/], int n);
-	Imf::Int64 tellg_file();
-	void seekg_file(Imf::Int64 pos);
+	bool read_file(char c[/*n*/], int n, Imf::Int64 pos) const;
 	Imf::Int64 file_size();
 	DateTime file_modtime();
+	void *map_file(Imf::Int64 size);
   
   
   private:
 	const SPBasicSuite *_pica_basicP;
 	void *_vfile;
-	Imf::Int64 _voffset;
 	Imf::Int64 _vsize;
+	Imf::Int64 _vprefetched;
+	FileMap *_vmap;
+	
+	Imf::Int64 _pos; // the file handle's own position isn't used
+	Imf::Int64 _fsize;
+	
+	CoalescedReader _reader;
 
 	PathString _path;
 	DateTime _modtime;
@@ -118,6 +177,50 @@ class IStreamPlatform : public Imf::IStream
 #ifdef WIN32
 	HANDLE _hFile;
 #endif
+
+#if !defined(__APPLE__) && !defined(WIN32)
+	int _fd;
+#endif
+};
+
+
+// Another read position on an IStreamPlatform, so separate files in
+// HybridInputFile can read from it at the same time.  It follows the
+// stream in and out of being memory mapped.
+class IStreamPlatformCursor : public Imf::IStream
+{
+  public:
+	IStreamPlatformCursor(const IStreamPlatform &stream);
+	
+	virtual bool isMemoryMapped() const;
+	virtual bool read(char c[/*n*/], int n);
+	virtual char *readMemoryMapped(int n);
+	virtual Imf::Int64 tellg();
+	virtual void seekg(Imf::Int64 pos);
+	
+  private:
+	const IStreamPlatform &_stream;
+	Imf::Int64 _pos;
+	
+	CoalescedReader _reader;
+};
+
+
+// Reads from a buffer the caller keeps around, like file headers
+// that came from somewhere other than the file.
+class IStreamMemory : public Imf::IStream
+{
+  public:
+	IStreamMemory(const char *buf, size_t len, const char fileName[] = "Memory Stream");
+	
+	virtual bool read(char c[/*n*/], int n);
+	virtual Imf::Int64 tellg();
+	virtual void seekg(Imf::Int64 pos);
+	
+  private:
+	const char *_buf;
+	Imf::Int64 _len;
+	Imf::Int64 _pos;
 };
 
 
@@ -125,15 +228,38 @@ class OStreamPlatform : public Imf::OStream
 {
   public:
   
-	OStreamPlatform(const char fileName[]);
-	OStreamPlatform(const uint16_t fileName[]);
+	// With write_behind, full buffers are written by a background thread
+	// while OpenEXR goes on compressing.
+	OStreamPlatform(const char fileName[], bool write_behind=false);
+	OStreamPlatform(const uint16_t fileName[], bool write_behind=false);
 	~OStreamPlatform();
 	
 	void write (const char c[/*n*/], int n);
 	Imf::Int64 tellp ();
 	void seekp (Imf::Int64 pos);
+	
+	// Waits for everything to get written and synced to the disk.  Call after
+	// the OpenEXR file is destroyed, because that's when the offsets get written.
+	// Throws if any write failed along the way.
+	void finish();
 
   private:
+	void init_buffer(bool write_behind);
+	void flush_buffer();
+	
+	// the platform part
+	void write_file(const char *c, size_t n, Imf::Int64 pos);
+	void sync_file();
+	void close_file();
+	
+	class WriteBehind;
+	friend class WriteBehind;
+	
+	WriteBehind *_behind;
+	
+	Imf::Int64 _pos; // file position of _buf
+	char *_buf;
+	size_t _buf_used;
 	
 #ifdef __APPLE__
 	FSRef _fsRef;
@@ -144,6 +270,115 @@ class OStreamPlatform : public Imf::OStream
 	HANDLE _hFile;
 #endif
 
+#if !defined(__APPLE__) && !defined(WIN32)
+	int _fd;
+#endif
+
+};
+
+
+// Watches the frames being drawn, and when they go through a sequence in order,
+// reads the next few in a background thread so their pages are already in memory.
+// With memory mapping on they're mapped and kept by the memory map cache, so they
+// count against its limit.  Otherwise they're just read to warm the OS file cache.
+class SequenceReadAhead
+{
+  public:
+	SequenceReadAhead();
+	~SequenceReadAhead();
+	
+	void configure(int frames, bool memory_map); // 0 frames stops the thread
+	
+	void frameRequested(const PathString &path, Imf::Int64 file_size);
+	
+  private:
+	class Worker;
+	friend class Worker;
+	
+	typedef std::vector<A_PathType> PathChars;
+	
+	typedef struct Sequence {
+		int			id;
+		PathChars	prefix;
+		PathChars	suffix;
+		int			digits;
+		long		last_frame;
+		long		queued_through;
+	} Sequence;
+	
+	typedef struct QueuedFrame {
+		int			sequence;
+		PathString	path;
+	} QueuedFrame;
+	
+	void cancelSequence(int id);
+	bool nextFrame(PathString &path);
+	bool frameCancelled();
+	void warmFrame(const PathString &path);
+	
+  private:
+	int _frames;
+	bool _memory_map;
+	
+	Worker *_worker;
+	IlmThread::Semaphore _work;
+	IlmThread::Semaphore _finished;
+	bool _quit;
+	
+	IlmThread::Mutex _mutex;
+	std::list<Sequence> _sequences; // most recent at the front
+	std::list<QueuedFrame> _queue;
+	int _next_id;
+	int _current_sequence;
+	bool _cancel_current;
+};
+
+
+// Runs jobs (like writing a frame) one at a time on a thread of its own, so AE can
+// go on rendering.  queue() waits when max_jobs are already waiting.  If a job throws,
+// the error comes back from the next queue() or finish().
+class BackgroundJobs
+{
+  public:
+	class Job
+	{
+	  public:
+		virtual ~Job() {}
+		
+		virtual void run() = 0;
+	};
+	
+	BackgroundJobs();
+	~BackgroundJobs();
+	
+	void configure(int max_jobs); // 0 stops the thread when the jobs are done
+	
+	bool running() const { return (_worker != NULL); }
+	
+	void queue(Job *job); // takes ownership, even if it throws
+	
+	void finish(); // waits for all the jobs to be done
+	
+  private:
+	class Worker;
+	friend class Worker;
+	
+	Job *nextJob();
+	void runJob(Job *job);
+	void throwError();
+	
+  private:
+	int _max_jobs;
+	
+	Worker *_worker;
+	IlmThread::Semaphore _work;
+	IlmThread::Semaphore _slots; // one for every job that could be queued or running
+	IlmThread::Semaphore _finished;
+	
+	IlmThread::Mutex _mutex;
+	std::list<Job *> _queue;
+	bool _failed;
+	std::string _error;
 };
 
 #endif // OPENEXR_PLATFORM_IO_H
\ No newline at end of file
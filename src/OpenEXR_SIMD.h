@@ -0,0 +1,280 @@
+//
+//	OpenEXR file importer/exporter for After Effects (AEIO)
+//
+//	by Brendan Bolles <brendan@fnordware.com>
+//
+//	see OpenEXR.cpp for more information
+//
+
+#ifndef OPENEXR_SIMD_H
+#define OPENEXR_SIMD_H
+
+#include <half.h>
+
+#include <stddef.h>
+
+
+// F16C converts 4 halfs to floats in one instruction.  We only use it if the compiler
+// can build it without special flags for the whole file, and check the CPU at run time.
+#if defined(_MSC_VER) && (_MSC_VER >= 1700) && (defined(_M_IX86) || defined(_M_X64))
+	#define OPENEXR_F16C
+	#define OPENEXR_F16C_TARGET
+	#include <intrin.h>
+	#include <immintrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+	#if defined(__clang__) && defined(__has_attribute)
+		#if __has_attribute(target)
+			#define OPENEXR_F16C
+		#endif
+	#elif defined(__GNUC__) && !defined(__clang__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+		#define OPENEXR_F16C
+	#endif
+	
+	#ifdef OPENEXR_F16C
+		#define OPENEXR_F16C_TARGET __attribute__((target("sse2,f16c")))
+		#include <cpuid.h>
+		#include <immintrin.h>
+	#endif
+#endif
+
+
+// Every arm64 CPU has NEON and half conversions, so no run time check there.
+#if defined(__aarch64__)
+	#define OPENEXR_NEON
+	#include <arm_neon.h>
+#endif
+
+
+#ifdef OPENEXR_F16C
+static inline bool
+DetectF16C()
+{
+	// F16C instructions are VEX encoded, so the OS has to be saving the AVX registers too
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	
+	const bool f16c = (info[2] & (1 << 29)) != 0;
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	
+	return (f16c && osxsave && ((_xgetbv(0) & 0x6) == 0x6));
+#else
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	
+	if( !__get_cpuid(1, &eax, &ebx, &ecx, &edx) )
+		return false;
+	
+	const bool f16c = (ecx & (1 << 29)) != 0;
+	const bool osxsave = (ecx & (1 << 27)) != 0;
+	
+	if(!f16c || !osxsave)
+		return false;
+	
+	unsigned int xcr0_lo = 0, xcr0_hi = 0;
+	
+	__asm__ __volatile__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+	
+	return ((xcr0_lo & 0x6) == 0x6);
+#endif
+}
+
+
+static inline bool
+CPUHasF16C()
+{
+	static const bool has_f16c = DetectF16C();
+	
+	return has_f16c;
+}
+
+
+OPENEXR_F16C_TARGET static inline void
+HalfToFloatRow_F16C(const half *in, float *out, int width)
+{
+	int x = 0;
+	
+	for(; x + 4 <= width; x += 4)
+	{
+		const __m128i h = _mm_loadl_epi64((const __m128i *)(in + x));
+		
+		_mm_storeu_ps(out + x, _mm_cvtph_ps(h));
+	}
+	
+	for(; x < width; x++)
+		out[x] = in[x];
+}
+
+
+OPENEXR_F16C_TARGET static inline void
+HalfToFloatInterleave_F16C(const half * const in[4], const float fill[4], float *out, int width)
+{
+	int x = 0;
+	
+	for(; x + 4 <= width; x += 4)
+	{
+		__m128 c0 = (in[0] ? _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)(in[0] + x))) : _mm_set1_ps(fill[0]));
+		__m128 c1 = (in[1] ? _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)(in[1] + x))) : _mm_set1_ps(fill[1]));
+		__m128 c2 = (in[2] ? _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)(in[2] + x))) : _mm_set1_ps(fill[2]));
+		__m128 c3 = (in[3] ? _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)(in[3] + x))) : _mm_set1_ps(fill[3]));
+		
+		// four planes of four pixels become four pixels of four channels
+		_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+		
+		_mm_storeu_ps(out + 0, c0);
+		_mm_storeu_ps(out + 4, c1);
+		_mm_storeu_ps(out + 8, c2);
+		_mm_storeu_ps(out + 12, c3);
+		
+		out += 16;
+	}
+	
+	for(; x < width; x++)
+	{
+		for(int c=0; c < 4; c++)
+			*out++ = (in[c] ? (float)in[c][x] : fill[c]);
+	}
+}
+
+
+OPENEXR_F16C_TARGET static inline void
+FloatToHalfDeinterleave_F16C(const float *in, half * const out[4], int width)
+{
+	int x = 0;
+	
+	for(; x + 4 <= width; x += 4)
+	{
+		__m128 c0 = _mm_loadu_ps(in + 0);
+		__m128 c1 = _mm_loadu_ps(in + 4);
+		__m128 c2 = _mm_loadu_ps(in + 8);
+		__m128 c3 = _mm_loadu_ps(in + 12);
+		
+		// four pixels of four channels become four planes of four pixels
+		_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+		
+		// round to nearest even, same as half's constructor
+		_mm_storel_epi64((__m128i *)(out[0] + x), _mm_cvtps_ph(c0, 0));
+		_mm_storel_epi64((__m128i *)(out[1] + x), _mm_cvtps_ph(c1, 0));
+		_mm_storel_epi64((__m128i *)(out[2] + x), _mm_cvtps_ph(c2, 0));
+		_mm_storel_epi64((__m128i *)(out[3] + x), _mm_cvtps_ph(c3, 0));
+		
+		in += 16;
+	}
+	
+	for(; x < width; x++)
+	{
+		for(int c=0; c < 4; c++)
+			out[c][x] = *in++;
+	}
+}
+#endif // OPENEXR_F16C
+
+
+#ifdef OPENEXR_NEON
+static inline void
+FloatToHalfDeinterleave_NEON(const float *in, half * const out[4], int width)
+{
+	int x = 0;
+	
+	for(; x + 4 <= width; x += 4)
+	{
+		// vld4 splits the channels apart as it loads
+		const float32x4x4_t pixels = vld4q_f32(in);
+		
+		for(int c=0; c < 4; c++)
+			vst1_u16((uint16_t *)(out[c] + x), vreinterpret_u16_f16(vcvt_f16_f32(pixels.val[c])));
+		
+		in += 16;
+	}
+	
+	for(; x < width; x++)
+	{
+		for(int c=0; c < 4; c++)
+			out[c][x] = *in++;
+	}
+}
+#endif // OPENEXR_NEON
+
+
+// half's float conversion is already a table lookup, so that's our fallback
+static inline void
+HalfToFloatRow(const half *in, float *out, ptrdiff_t out_step, int width)
+{
+#ifdef OPENEXR_F16C
+	if(out_step == 1 && CPUHasF16C())
+	{
+		HalfToFloatRow_F16C(in, out, width);
+		
+		return;
+	}
+#endif
+	
+	while(width--)
+	{
+		*out = *in++;
+		
+		out += out_step;
+	}
+}
+
+
+// Fill four interleaved float channels from four half planes.
+// NULL planes get their fill value.
+static inline void
+HalfToFloatInterleave(const half * const in[4], const float fill[4], float *out, int width)
+{
+#ifdef OPENEXR_F16C
+	if( CPUHasF16C() )
+	{
+		HalfToFloatInterleave_F16C(in, fill, out, width);
+		
+		return;
+	}
+#endif
+	
+	for(int c=0; c < 4; c++)
+	{
+		float *o = out + c;
+		
+		if(in[c] == NULL)
+		{
+			for(int x=0; x < width; x++, o += 4)
+				*o = fill[c];
+		}
+		else
+		{
+			const half *i = in[c];
+			
+			for(int x=0; x < width; x++, o += 4)
+				*o = *i++;
+		}
+	}
+}
+
+
+// Split four interleaved float channels into four half planes.
+// half's constructor rounds to nearest even, and so do the vector paths.
+static inline void
+FloatToHalfDeinterleave(const float *in, half * const out[4], int width)
+{
+#if defined(OPENEXR_NEON)
+	FloatToHalfDeinterleave_NEON(in, out, width);
+#else
+#ifdef OPENEXR_F16C
+	if( CPUHasF16C() )
+	{
+		FloatToHalfDeinterleave_F16C(in, out, width);
+		
+		return;
+	}
+#endif
+	
+	for(int x=0; x < width; x++)
+	{
+		for(int c=0; c < 4; c++)
+			out[c][x] = *in++;
+	}
+#endif
+}
+
+
+#endif // OPENEXR_SIMD_H
@@ -18,10 +18,13 @@ typedef enum {
     IBOutlet NSButton *floatCheck;
 	IBOutlet NSTextField *floatLabel;
     IBOutlet NSButton *lumiChromCheck;
+    IBOutlet NSPopUpButton *tilesPulldown;
+    IBOutlet NSPopUpButton *tileSizePulldown;
 	BOOL subDialog;
 	DialogResult theResult;
 }
 - (IBAction)trackLumiChrom:(id)sender;
+- (IBAction)trackTiles:(id)sender;
 - (IBAction)clickOK:(id)sender;
 - (IBAction)clickCancel:(id)sender;
 - (NSWindow *)getWindow;
@@ -34,4 +37,8 @@ typedef enum {
 - (void)setLumiChrom:(BOOL)lumiChrom;
 - (BOOL)getFloat;
 - (void)setFloat:(BOOL)useFloat;
+- (NSInteger)getTiles;
+- (void)setTiles:(NSInteger)tiles;
+- (NSInteger)getTileSize;
+- (void)setTileSize:(NSInteger)tileSize;
 @end
@@ -12,6 +12,14 @@
 	[compressionPulldown removeAllItems];
 	[compressionPulldown addItemsWithTitles:
 		[NSArray arrayWithObjects:@"None", @"RLE", @"Zip", @"Zip16", @"Piz", @"PXR24", @"B44", @"B44A", @"DWAA", @"DWAB", nil]];
+	
+	[tilesPulldown removeAllItems];
+	[tilesPulldown addItemsWithTitles:
+		[NSArray arrayWithObjects:@"None", @"One Level", @"Mipmap", @"Ripmap", nil]];
+	
+	[tileSizePulldown removeAllItems];
+	[tileSizePulldown addItemsWithTitles:
+		[NSArray arrayWithObjects:@"32", @"64", @"128", @"256", nil]];
 
 	theResult = DIALOG_RESULT_CONTINUE;
 
@@ -26,6 +34,15 @@
 	[floatLabel setTextColor:label_color];
 	
 	[label_color release];
+	
+	[self trackTiles:nil];
+}
+
+- (IBAction)trackTiles:(id)sender {
+	const BOOL lumiChrom = ([lumiChromCheck state] == NSOnState);
+	
+	[tilesPulldown setEnabled:!lumiChrom];
+	[tileSizePulldown setEnabled:(!lumiChrom && [tilesPulldown indexOfSelectedItem] != 0)];
 }
 
 - (IBAction)clickOK:(id)sender {
@@ -78,4 +95,21 @@
 - (void)setFloat:(BOOL)useFloat {
 	[floatCheck setState:(useFloat ? NSOnState : NSOffState)];
 }
+
+- (NSInteger)getTiles {
+	return [tilesPulldown indexOfSelectedItem];
+}
+
+- (void)setTiles:(NSInteger)tiles {
+	[tilesPulldown selectItem:[tilesPulldown itemAtIndex:tiles]];
+	[self trackTiles:nil];
+}
+
+- (NSInteger)getTileSize {
+	return [[tileSizePulldown titleOfSelectedItem] integerValue];
+}
+
+- (void)setTileSize:(NSInteger)tileSize {
+	[tileSizePulldown selectItemWithTitle:[NSString stringWithFormat:@"%d", (int)tileSize]];
+}
 @end
@@ -223,6 +223,8 @@ OpenEXR_OutDialog(
 			[ui_controller setCompression:options->compression_type];
 			[ui_controller setLumiChrom:options->luminance_chroma];
 			[ui_controller setFloat:options->float_not_half];
+			[ui_controller setTiles:options->tiles];
+			[ui_controller setTileSize:(1 << (options->tile_size_log2 ? options->tile_size_log2 : TILE_SIZE_DEFAULT_LOG2))];
 			
 			NSWindow *my_window = [ui_controller getWindow];
 							
@@ -257,6 +259,17 @@ OpenEXR_OutDialog(
 					options->compression_type = [ui_controller getCompression];
 					options->luminance_chroma = [ui_controller getLumiChrom];
 					options->float_not_half = [ui_controller getFloat];
+					options->tiles = [ui_controller getTiles];
+					
+					const NSInteger tile_size = [ui_controller getTileSize];
+					
+					options->tile_size_log2 = TILE_SIZE_DEFAULT_LOG2;
+					
+					for(int i = TILE_SIZE_MIN_LOG2; i <= TILE_SIZE_MAX_LOG2; i++)
+					{
+						if(tile_size == (1 << i))
+							options->tile_size_log2 = i;
+					}
 					
 					*user_interactedPB0 = TRUE;
 				}
@@ -10,6 +10,8 @@
 
 #include <Windows.h>
 
+#include <stdio.h>
+
 // dialog comtrols
 enum {
 	OUT_noUI = -1,
@@ -18,7 +20,9 @@ enum {
 	OUT_Compression_Menu = 3,
 	OUT_LumiChrom_Check,
 	OUT_Float_Check,
-	OUT_Float_NotRecom
+	OUT_Float_NotRecom,
+	OUT_Tiles_Menu,
+	OUT_TileSize_Menu
 };
 
 
@@ -46,6 +50,19 @@ static WORD	g_item_clicked = 0;
 static A_u_char		g_Compression	= OUT_PIZ_COMPRESSION;
 static A_Boolean	g_lumi_chrom	= FALSE;
 static A_Boolean	g_32bit_float	= FALSE;
+static TileMode		g_tiles			= TILES_NONE;
+static A_u_char		g_tile_size_log2 = TILE_SIZE_DEFAULT_LOG2;
+
+
+static void TrackTiles(HWND hwndDlg)
+{
+	BOOL lumi_chrom = SendMessage(GetDlgItem(hwndDlg, OUT_LumiChrom_Check), BM_GETCHECK, (WPARAM)0, (LPARAM)0);
+
+	LRESULT tiles = SendMessage(GetDlgItem(hwndDlg, OUT_Tiles_Menu), (UINT)CB_GETCURSEL, (WPARAM)0, (LPARAM)0);
+
+	EnableWindow(GetDlgItem(hwndDlg, OUT_Tiles_Menu), !lumi_chrom);
+	EnableWindow(GetDlgItem(hwndDlg, OUT_TileSize_Menu), !lumi_chrom && tiles != TILES_NONE);
+}
 
 
 static void TrackLumiChrom(HWND hwndDlg)
@@ -54,6 +71,8 @@ static void TrackLumiChrom(HWND hwndDlg)
 
 	EnableWindow(GetDlgItem(hwndDlg, OUT_Float_Check), enable_state);
 	EnableWindow(GetDlgItem(hwndDlg, OUT_Float_NotRecom), enable_state);
+
+	TrackTiles(hwndDlg);
 }
 
 
@@ -92,6 +111,38 @@ static BOOL CALLBACK DialogProc(HWND hwndDlg, UINT message, WPARAM wParam, LPARA
 				}
 			}while(0);
 
+			do{
+				const char *opts[] = {	"None",
+										"One Level",
+										"Mipmap",
+										"Ripmap" };
+
+				HWND menu = GetDlgItem(hwndDlg, OUT_Tiles_Menu);
+
+				for(int i=TILES_NONE; i <= TILES_RIPMAP; i++)
+				{
+					SendMessage(menu,( UINT)CB_ADDSTRING, (WPARAM)wParam, (LPARAM)(LPCTSTR)opts[i] );
+					SendMessage( menu,(UINT)CB_SETITEMDATA, (WPARAM)i, (LPARAM)(DWORD)i);
+
+					if(i == g_tiles)
+						SendMessage( menu, CB_SETCURSEL, (WPARAM)i, (LPARAM)0);
+				}
+
+				menu = GetDlgItem(hwndDlg, OUT_TileSize_Menu);
+
+				for(int i=TILE_SIZE_MIN_LOG2; i <= TILE_SIZE_MAX_LOG2; i++)
+				{
+					char size_str[16];
+					sprintf(size_str, "%d", (1 << i));
+
+					SendMessage(menu,( UINT)CB_ADDSTRING, (WPARAM)wParam, (LPARAM)(LPCTSTR)size_str );
+					SendMessage( menu,(UINT)CB_SETITEMDATA, (WPARAM)(i - TILE_SIZE_MIN_LOG2), (LPARAM)(DWORD)i); // the size as a power of 2
+
+					if(i == g_tile_size_log2)
+						SendMessage( menu, CB_SETCURSEL, (WPARAM)(i - TILE_SIZE_MIN_LOG2), (LPARAM)0);
+				}
+			}while(0);
+
 			SendMessage(GetDlgItem(hwndDlg, OUT_LumiChrom_Check), BM_SETCHECK, (WPARAM)g_lumi_chrom, (LPARAM)0);
 			SendMessage(GetDlgItem(hwndDlg, OUT_Float_Check), BM_SETCHECK, (WPARAM)g_32bit_float, (LPARAM)0);
 
@@ -117,6 +168,14 @@ static BOOL CALLBACK DialogProc(HWND hwndDlg, UINT message, WPARAM wParam, LPARA
 						g_lumi_chrom = SendMessage(GetDlgItem(hwndDlg, OUT_LumiChrom_Check), BM_GETCHECK, (WPARAM)0, (LPARAM)0);
 						g_32bit_float = SendMessage(GetDlgItem(hwndDlg, OUT_Float_Check), BM_GETCHECK, (WPARAM)0, (LPARAM)0);
 
+						menu = GetDlgItem(hwndDlg, OUT_Tiles_Menu);
+						cur_sel = SendMessage(menu,(UINT)CB_GETCURSEL, (WPARAM)0, (LPARAM)0);
+						g_tiles = SendMessage(menu,(UINT)CB_GETITEMDATA, (WPARAM)cur_sel, (LPARAM)0);
+
+						menu = GetDlgItem(hwndDlg, OUT_TileSize_Menu);
+						cur_sel = SendMessage(menu,(UINT)CB_GETCURSEL, (WPARAM)0, (LPARAM)0);
+						g_tile_size_log2 = SendMessage(menu,(UINT)CB_GETITEMDATA, (WPARAM)cur_sel, (LPARAM)0);
+
 					}while(0);
 
 					//PostMessage((HWND)hwndDlg, WM_QUIT, (WPARAM)WA_ACTIVE, lParam);
@@ -127,6 +186,11 @@ static BOOL CALLBACK DialogProc(HWND hwndDlg, UINT message, WPARAM wParam, LPARA
 				case OUT_LumiChrom_Check:
 					TrackLumiChrom(hwndDlg);
 					return TRUE;
+
+				case OUT_Tiles_Menu:
+					if(HIWORD(wParam) == CBN_SELCHANGE)
+						TrackTiles(hwndDlg);
+					return TRUE;
             } 
     } 
     return FALSE; 
@@ -163,6 +227,8 @@ OpenEXR_OutDialog(
 	g_Compression = options->compression_type;
 	g_lumi_chrom = options->luminance_chroma;
 	g_32bit_float = options->float_not_half;
+	g_tiles = options->tiles;
+	g_tile_size_log2 = (options->tile_size_log2 ? options->tile_size_log2 : TILE_SIZE_DEFAULT_LOG2);
 	
 
 	// do dialog, passing plug-in path in refcon
@@ -174,6 +240,8 @@ OpenEXR_OutDialog(
 		options->compression_type = g_Compression;
 		options->luminance_chroma = g_lumi_chrom;
 		options->float_not_half = g_32bit_float;
+		options->tiles = g_tiles;
+		options->tile_size_log2 = g_tile_size_log2;
 		
 		*user_interactedPB0 = TRUE;
 	}